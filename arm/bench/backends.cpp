@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * epoll versus io_uring: system calls and CPU time spent by the server per
+ * 64x32 frame received over TCP loopback, from a client sending as fast as
+ * it can or paced at 500 fps.
+ */
+
+#include "opcserver.hpp"
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace epilepsia;
+
+static const uint16_t port = 7899;
+static const int frame_size = 64 * 32 * 3;
+
+static void send_frames(int frames, int interval_us)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (sockaddr*)&address, sizeof(address)) != 0) {
+        std::exit(EXIT_FAILURE);
+    }
+
+    std::vector<uint8_t> message(4 + frame_size, 0x55);
+    message[0] = 0;
+    message[1] = 0;
+    message[2] = frame_size >> 8;
+    message[3] = frame_size & 0xFF;
+
+    auto next = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        if (send(sock, message.data(), message.size(), 0) != static_cast<ssize_t>(message.size())) {
+            std::exit(EXIT_FAILURE);
+        }
+        if (interval_us) {
+            next += std::chrono::microseconds(interval_us);
+            std::this_thread::sleep_until(next);
+        }
+    }
+    close(sock);
+    std::exit(EXIT_SUCCESS);
+}
+
+static double cpu_us()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static bool run(io_backend backend, int frames, int interval_us)
+{
+    opc_server_settings settings;
+    settings.ports = { port };
+    settings.backend = backend;
+    opc_server server(settings);
+
+    // The main thread sleeps until every frame is received, so that the CPU
+    // time of the process is the CPU time of the server thread
+    std::atomic<int> received{ 0 };
+    std::mutex mutex;
+    std::condition_variable all_received;
+    server.set_handler<opc_command::set_pixels>([&](uint8_t, uint16_t, const uint8_t*) {
+        if (++received == frames) {
+            std::lock_guard<std::mutex> lock(mutex);
+            all_received.notify_one();
+        }
+    });
+    server.set_handler<opc_command::system_exclusive>([](uint8_t, uint16_t, const uint8_t*) {});
+    if (!server.start()) {
+        return false;
+    }
+
+    uint64_t syscalls = server.stats().syscalls;
+    double cpu = cpu_us();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        send_frames(frames, interval_us);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        all_received.wait_for(lock, std::chrono::seconds(30), [&] { return received == frames; });
+    }
+    cpu = cpu_us() - cpu;
+    syscalls = server.stats().syscalls - syscalls;
+    waitpid(pid, nullptr, 0);
+    server.stop();
+
+    std::printf("%10s %8s %10d %14.2f %14.2f\n", backend == io_backend::io_uring ? "io_uring" : "epoll",
+        interval_us ? "500 fps" : "burst", received.load(),
+        static_cast<double>(syscalls) / received, cpu / received);
+    return received == frames;
+}
+
+int main()
+{
+    std::printf("%10s %8s %10s %14s %14s\n", "backend", "client", "frames", "syscalls/frame", "cpu us/frame");
+    for (int interval : { 0, 2000 }) {
+        const int frames = interval ? 2000 : 20000;
+        for (auto backend : { io_backend::epoll, io_backend::io_uring }) {
+            if (!run(backend, frames, interval)) {
+                std::printf("Lost frames\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
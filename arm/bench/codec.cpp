@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Compressed frames: size on the wire and decoding time for a 64x32 display.
+ * The encoders below are naive, they are only here to feed the decoders.
+ */
+
+#include "framecodec.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace epilepsia;
+
+using bytes = std::vector<uint8_t>;
+
+static bytes encode_rle(const bytes& in)
+{
+    bytes out;
+    const int pixels = in.size() / 3;
+    auto same = [&](int a, int b) { return std::memcmp(&in[a * 3], &in[b * 3], 3) == 0; };
+
+    for (int i = 0; i < pixels;) {
+        int j = i;
+        while (j + 1 < pixels && j - i < 127 && same(j + 1, i)) {
+            j++;
+        }
+        if (j > i) {
+            out.push_back(127 + j - i + 1);
+            out.insert(out.end(), &in[i * 3], &in[i * 3] + 3);
+        } else {
+            while (j + 1 < pixels && j - i < 127 && !same(j + 1, j)) {
+                j++;
+            }
+            out.push_back(j - i);
+            out.insert(out.end(), &in[i * 3], &in[(j + 1) * 3]);
+        }
+        i = j + 1;
+    }
+    return out;
+}
+
+static bytes encode_lz4(const bytes& in)
+{
+    bytes out;
+    std::vector<int> table(4096, -1);
+    const int len = in.size();
+    int anchor = 0;
+
+    auto put_length = [&](int l) {
+        for (; l >= 255; l -= 255) {
+            out.push_back(255);
+        }
+        out.push_back(l);
+    };
+
+    // The last match must start at least 12 bytes before the end of the block
+    for (int i = 0; i + 12 < len;) {
+        uint32_t seq;
+        std::memcpy(&seq, &in[i], 4);
+        uint32_t h = (seq * 2654435761u) >> 20;
+        int ref = table[h];
+        table[h] = i;
+
+        if (ref < 0 || i - ref > 65535 || std::memcmp(&in[ref], &in[i], 4) != 0) {
+            i++;
+            continue;
+        }
+
+        int match = 4;
+        while (i + match + 5 < len && in[ref + match] == in[i + match]) {
+            match++;
+        }
+
+        int literals = i - anchor;
+        out.push_back((std::min(literals, 15) << 4) | std::min(match - 4, 15));
+        if (literals >= 15) {
+            put_length(literals - 15);
+        }
+        out.insert(out.end(), &in[anchor], &in[i]);
+        out.push_back((i - ref) & 0xFF);
+        out.push_back((i - ref) >> 8);
+        if (match - 4 >= 15) {
+            put_length(match - 4 - 15);
+        }
+
+        i += match;
+        anchor = i;
+    }
+
+    int literals = len - anchor;
+    out.push_back(std::min(literals, 15) << 4);
+    if (literals >= 15) {
+        put_length(literals - 15);
+    }
+    out.insert(out.end(), &in[anchor], &in[0] + len);
+    return out;
+}
+
+static bytes encode_qoi(const bytes& in, uint32_t width, uint32_t height)
+{
+    bytes out = { 'q', 'o', 'i', 'f',
+        uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+        uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height), 3, 0 };
+    uint8_t index[64][3] = {};
+    uint8_t prev[3] = { 0, 0, 0 };
+    const int pixels = width * height;
+    int run = 0;
+
+    for (int i = 0; i < pixels; i++) {
+        const uint8_t* px = &in[i * 3];
+
+        if (std::memcmp(px, prev, 3) == 0) {
+            if (++run == 62 || i == pixels - 1) {
+                out.push_back(0xC0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            out.push_back(0xC0 | (run - 1));
+            run = 0;
+        }
+
+        int h = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+        if (std::memcmp(index[h], px, 3) == 0) {
+            out.push_back(h);
+        } else {
+            std::memcpy(index[h], px, 3);
+            int vr = int8_t(px[0] - prev[0]), vg = int8_t(px[1] - prev[1]), vb = int8_t(px[2] - prev[2]);
+            int vg_r = vr - vg, vg_b = vb - vg;
+            if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                out.push_back(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+            } else if (vg > -33 && vg < 32 && vg_r > -9 && vg_r < 8 && vg_b > -9 && vg_b < 8) {
+                out.push_back(0x80 | (vg + 32));
+                out.push_back((vg_r + 8) << 4 | (vg_b + 8));
+            } else {
+                out.insert(out.end(), { 0xFE, px[0], px[1], px[2] });
+            }
+        }
+        std::memcpy(prev, px, 3);
+    }
+
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+    return out;
+}
+
+static bytes make_frame(int content, int width, int height)
+{
+    bytes frame(width * height * 3, 0);
+    auto fill = [&](int x0, int y0, int w, int h, uint8_t r, uint8_t g, uint8_t b) {
+        for (int y = y0; y < y0 + h && y < height; y++) {
+            for (int x = x0; x < x0 + w && x < width; x++) {
+                uint8_t* p = &frame[(y * width + x) * 3];
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+            }
+        }
+    };
+
+    if (content == 0) {
+        // Text or shapes on a black background
+        for (int i = 0; i < 12; i++) {
+            fill(std::rand() % width, std::rand() % height, 1 + std::rand() % 12, 1 + std::rand() % 6,
+                std::rand(), std::rand(), std::rand());
+        }
+    } else if (content == 1) {
+        // Smooth gradient
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                fill(x, y, 1, 1, x * 4, y * 8, 128);
+            }
+        }
+    } else {
+        // Noise, the worst case
+        for (auto& b : frame) {
+            b = std::rand();
+        }
+    }
+    return frame;
+}
+
+int main()
+{
+    const int width = 64, height = 32;
+    const char* contents[] = { "shapes", "gradient", "noise" };
+    const char* codecs[] = { "rle", "lz4", "qoi" };
+    const int iterations = 5000;
+
+    std::printf("%10s %6s %10s %10s %12s\n", "content", "codec", "raw bytes", "bytes", "decode us");
+    for (int content = 0; content < 3; content++) {
+        bytes frame = make_frame(content, width, height);
+        bytes encoded[] = { encode_rle(frame), encode_lz4(frame), encode_qoi(frame, width, height) };
+
+        for (int codec = 0; codec < 3; codec++) {
+            bytes out(frame.size());
+            const bytes& in = encoded[codec];
+
+            auto start = std::chrono::steady_clock::now();
+            int n = 0;
+            for (int i = 0; i < iterations; i++) {
+                n = decode_frame(static_cast<frame_codec>(codec), in.data(), in.size(), out.data(), out.size());
+                asm volatile("" : : "r"(out.data()) : "memory");
+            }
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+            if (n != static_cast<int>(frame.size()) || out != frame) {
+                std::printf("%s: decoding failed\n", codecs[codec]);
+                return EXIT_FAILURE;
+            }
+            std::printf("%10s %6s %10zu %10zu %12.1f\n", contents[content], codecs[codec],
+                frame.size(), in.size(), elapsed.count() / iterations);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
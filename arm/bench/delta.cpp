@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Full frames versus delta frames: bytes on the wire and CPU time per frame
+ * spent composing and rendering, for content that changes a few percent of
+ * its pixels per frame (a ticker, a status panel...).
+ */
+
+#include "framecomposer.hpp"
+#include "framerenderer.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace epilepsia;
+
+struct result {
+    double us;
+    size_t bytes;
+};
+
+static result run(int strip_length, int strip_count, bool delta, bool incremental, int changed_percent)
+{
+    led_driver_settings settings;
+    settings.strip_length = strip_length;
+    settings.strip_count = strip_count;
+    frame_composer composer(frame_composer_settings{}, settings);
+    frame_renderer renderer(settings);
+
+    const int frame_size = strip_length * strip_count * 3;
+    const int runs = 8;
+    const int run_length = frame_size * changed_percent / 100 / runs / 3 * 3;
+    const int frames = 2000;
+
+    std::vector<uint8_t> frame(frame_size, 0);
+    std::vector<uint8_t> message;
+    std::vector<uint8_t> buffer(frame_size);
+    size_t bytes = 0;
+    std::chrono::nanoseconds elapsed{ 0 };
+
+    for (int f = 0; f < frames; f++) {
+        // The client updates a few runs of pixels
+        message.clear();
+        for (int r = 0; r < runs; r++) {
+            int offset = (std::rand() % (frame_size - run_length)) / 3 * 3;
+            message.push_back(offset >> 8);
+            message.push_back(offset & 0xFF);
+            message.push_back(run_length >> 8);
+            message.push_back(run_length & 0xFF);
+            for (int i = 0; i < run_length; i++) {
+                frame[offset + i] = std::rand();
+                message.push_back(frame[offset + i]);
+            }
+        }
+
+        if (!incremental) {
+            // Forces a complete render, as if every LED had changed
+            renderer.invalidate();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        if (delta) {
+            composer.write_ranges(0, message.data(), message.size());
+            bytes += 4 + 1 + message.size();
+        } else {
+            composer.write(0, frame.data(), frame_size);
+            bytes += 4 + frame_size;
+        }
+        // The output thread works on its own copy of the frame
+        std::copy_n(composer.compose(), frame_size, buffer.begin());
+        renderer.render(buffer.data(), frame_size);
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+
+    return { std::chrono::duration<double, std::micro>(elapsed).count() / frames, bytes / frames };
+}
+
+int main()
+{
+    std::printf("%10s %8s %12s %16s %12s %12s\n", "geometry", "changed", "full bytes", "full render us", "delta bytes", "delta us");
+    for (auto g : { std::make_pair(64, 32), std::make_pair(120, 16) }) {
+        for (int percent : { 1, 3, 10, 30 }) {
+            result full = run(g.first, g.second, false, false, percent);
+            result delta = run(g.first, g.second, true, true, percent);
+            std::printf("%6dx%-3d %7d%% %12zu %16.1f %12zu %12.1f\n", g.first, g.second, percent,
+                full.bytes, full.us, delta.bytes, delta.us);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
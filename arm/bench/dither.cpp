@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Gamma correction and temporal dithering of a frame: byte by byte
+ * reference versus the vectorized kernel (NEON on ARM, SSE2 on x86), in
+ * microseconds per frame. Both must produce the same bytes, residuals and
+ * levels for every length.
+ */
+
+#include "dithering.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace epilepsia;
+
+using kernel = void (*)(uint8_t*, const uint16_t*, int16_t*, int, int*);
+
+static uint16_t lut[256];
+
+static bool check(int n)
+{
+    std::vector<uint8_t> expected(n), actual(n);
+    std::vector<int16_t> expected_residual(n), actual_residual(n);
+
+    // Residuals carry over, compare a few frames in a row
+    for (int f = 0; f < 8; f++) {
+        for (auto& b : expected) {
+            b = std::rand();
+        }
+        actual = expected;
+
+        int expected_level[3] = {}, actual_level[3] = {};
+        dither_bytes_reference(expected.data(), lut, expected_residual.data(), n, expected_level);
+        dither_bytes(actual.data(), lut, actual_residual.data(), n, actual_level);
+        if (expected != actual || expected_residual != actual_residual
+            || std::memcmp(expected_level, actual_level, sizeof(expected_level)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static double run(kernel k, int strip_length, int strip_count)
+{
+    const int n = strip_length * 3;
+    const int frames = 2000;
+    std::vector<uint8_t> frame(n * strip_count);
+    std::vector<uint8_t> buffer(frame.size());
+    std::vector<int16_t> residual(frame.size());
+    int level[3] = {};
+
+    for (auto& b : frame) {
+        b = std::rand();
+    }
+
+    // One strip at a time, like the renderer does for each block
+    auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; f++) {
+        frame[f % frame.size()] ^= f;
+        std::memcpy(buffer.data(), frame.data(), frame.size());
+        for (int s = 0; s < strip_count; s++) {
+            k(buffer.data() + s * n, lut, residual.data() + s * n, n, level);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    // Keep the compiler from optimizing the loop away
+    if (level[0] == 0x12345678) {
+        std::printf(" ");
+    }
+
+    return std::chrono::duration<double, std::micro>(elapsed).count() / frames;
+}
+
+int main()
+{
+    for (int i = 0; i < 256; i++) {
+        lut[i] = i * i * 0x101 / 255;
+    }
+
+#if defined(EPILEPSIA_DITHERING_NEON)
+    std::printf("Kernel: NEON\n");
+#elif defined(EPILEPSIA_DITHERING_SSE2)
+    std::printf("Kernel: SSE2\n");
+#else
+    std::printf("Kernel: reference\n");
+#endif
+
+    for (int n = 0; n <= 1536; n++) {
+        if (!check(n)) {
+            std::printf("%d bytes: output differs from the reference\n", n);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const int configs[][2] = { { 64, 32 }, { 120, 16 }, { 64, 8 } };
+    for (auto& c : configs) {
+        double reference = run(dither_bytes_reference, c[0], c[1]);
+        double vectorized = run(dither_bytes, c[0], c[1]);
+        std::printf("%2d strips of %d LEDs: reference %8.2f us, vectorized %8.2f us (x%.1f)\n",
+            c[1], c[0], reference, vectorized, reference / vectorized);
+    }
+    return EXIT_SUCCESS;
+}
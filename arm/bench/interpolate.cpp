@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Cost of a blended frame of a 64x32 display, compared to the time spent
+ * rendering it. At 30 fps input, about 15 blended frames are rendered
+ * between two frames received.
+ */
+
+#include "frameinterpolator.hpp"
+#include "framerenderer.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace epilepsia;
+
+int main()
+{
+    led_driver_settings driver;
+    driver.strip_length = 64;
+    driver.strip_count = 32;
+    const int frame_size = driver.strip_length * driver.strip_count * 3;
+    const int frames = 5000;
+    const int blended = 15;
+
+    std::vector<uint8_t> frame(frame_size);
+    for (auto& b : frame) {
+        b = std::rand();
+    }
+
+    frame_interpolator interpolator(frame_size);
+    frame_renderer renderer(driver);
+
+    // Frames 33 ms apart, the blending is driven by a simulated clock
+    const auto interval = std::chrono::microseconds(33333);
+    auto arrival = frame_interpolator::clock::now();
+    std::chrono::nanoseconds blend{ 0 }, render{ 0 };
+    uint32_t sum = 0;
+
+    for (int f = 0; f < frames; f++) {
+        for (auto& b : frame) {
+            b += 7;
+        }
+        arrival += interval;
+        interpolator.push(frame.data(), frame_size, arrival);
+
+        for (int i = 1; i <= blended; i++) {
+            auto start = std::chrono::steady_clock::now();
+            const uint8_t* out = interpolator.next(arrival + interval * i / (blended + 1));
+            auto middle = std::chrono::steady_clock::now();
+            sum += renderer.render(out, frame_size)[i];
+            auto end = std::chrono::steady_clock::now();
+            blend += middle - start;
+            render += end - middle;
+        }
+    }
+
+    // Keep the compiler from optimizing the renderer away
+    if (sum == 0x12345678) {
+        std::printf(" ");
+    }
+
+    std::printf("%12s %12s\n", "blend us", "render us");
+    std::printf("%12.2f %12.1f\n",
+        std::chrono::duration<double, std::micro>(blend).count() / (frames * blended),
+        std::chrono::duration<double, std::micro>(render).count() / (frames * blended));
+
+    return EXIT_SUCCESS;
+}
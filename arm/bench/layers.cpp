@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Cost of compositing layers over the base frame of a 64x32 display,
+ * compared to the time spent rendering the result.
+ */
+
+#include "framecomposer.hpp"
+#include "framerenderer.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace epilepsia;
+
+int main()
+{
+    led_driver_settings driver;
+    driver.strip_length = 64;
+    driver.strip_count = 32;
+    const int frame_size = driver.strip_length * driver.strip_count * 3;
+    const int frames = 5000;
+
+    std::vector<uint8_t> frame(frame_size);
+    std::vector<uint8_t> buffer(frame_size);
+    for (auto& b : frame) {
+        b = std::rand();
+    }
+
+    const layer_blend blends[] = { layer_blend::normal, layer_blend::add, layer_blend::lighten };
+
+    std::printf("%8s %12s %12s\n", "layers", "compose us", "render us");
+    for (int count = 0; count <= 3; count++) {
+        frame_composer_settings settings;
+        for (int i = 0; i < count; i++) {
+            settings.layers.push_back({ static_cast<uint8_t>(i + 1), i, 0.5f, blends[i], 0 });
+        }
+
+        frame_composer composer(settings, driver);
+        frame_renderer renderer(driver);
+        for (int c = 0; c <= count; c++) {
+            composer.write(c, frame.data(), frame_size);
+        }
+
+        std::chrono::nanoseconds compose{ 0 }, render{ 0 };
+        for (int f = 0; f < frames; f++) {
+            auto start = std::chrono::steady_clock::now();
+            std::copy_n(composer.compose(), frame_size, buffer.begin());
+            auto middle = std::chrono::steady_clock::now();
+            renderer.update_lut();
+            renderer.render(buffer.data(), frame_size);
+            auto end = std::chrono::steady_clock::now();
+            compose += middle - start;
+            render += end - middle;
+        }
+
+        std::printf("%8d %12.1f %12.1f\n", count,
+            std::chrono::duration<double, std::micro>(compose).count() / frames,
+            std::chrono::duration<double, std::micro>(render).count() / frames);
+    }
+
+    return EXIT_SUCCESS;
+}
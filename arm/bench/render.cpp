@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * Time spent by frame_renderer per frame, for frames where every LED
+ * changes, with and without dithering, for frames where a single
+ * LED changes and for dithered 16 bit frames.
+ */
+
+#include "framerenderer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace epilepsia;
+
+enum class content {
+    changing,
+    dithered,
+    single_led,
+    wide
+};
+
+static double run_once(int strip_length, int strip_count, content c)
+{
+    led_driver_settings settings;
+    settings.strip_length = strip_length;
+    settings.strip_count = strip_count;
+    settings.dithering = c == content::dithered || c == content::wide;
+    settings.brightness = 0.5f;
+    frame_renderer renderer(settings);
+
+    const int frame_size = strip_length * strip_count * 3 * (c == content::wide ? 2 : 1);
+    const pixel_format format = c == content::wide ? pixel_format::rgb16 : pixel_format::rgb8;
+    const int frames = 2000;
+    std::vector<uint8_t> frame(frame_size);
+    std::chrono::nanoseconds elapsed{ 0 };
+    uint32_t sum = 0;
+
+    for (auto& p : frame) {
+        p = std::rand();
+    }
+
+    for (int f = 0; f < frames; f++) {
+        if (c == content::single_led) {
+            frame[std::rand() % frame_size]++;
+        } else {
+            for (auto& p : frame) {
+                p += 7;
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        sum += renderer.render(frame.data(), frame_size, format)[f % (renderer.frame_buffer_size() / 4)];
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+
+    // Keep the compiler from optimizing the renderer away
+    if (sum == 0x12345678) {
+        std::printf(" ");
+    }
+
+    return std::chrono::duration<double, std::micro>(elapsed).count() / frames;
+}
+
+// Best of a few runs, the dev hosts are noisy
+static double run(int strip_length, int strip_count, content c)
+{
+    double best = run_once(strip_length, strip_count, c);
+    for (int i = 0; i < 4; i++) {
+        best = std::min(best, run_once(strip_length, strip_count, c));
+    }
+    return best;
+}
+
+int main()
+{
+    const int configs[][2] = { { 64, 32 }, { 120, 16 }, { 64, 8 } };
+
+    std::printf("%10s %12s %12s %12s %12s\n", "LEDs", "changing", "dithered", "single LED", "16 bits");
+    for (auto& config : configs) {
+        std::printf("%6dx%-3d %9.1f us %9.1f us %9.1f us %9.1f us\n", config[0], config[1],
+            run(config[0], config[1], content::changing),
+            run(config[0], config[1], content::dithered),
+            run(config[0], config[1], content::single_led),
+            run(config[0], config[1], content::wide));
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * Bit interleaving of a frame for the PRUs: bit by bit reference versus
+ * the vectorized kernel (NEON on ARM, SSE2 on x86), in microseconds per
+ * frame. Both must produce the same output for every strip length.
+ */
+
+#include "bittranspose.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace epilepsia;
+
+using kernel = void (*)(const uint32_t*, uint32_t*, int, int, int);
+
+template <typename T>
+static bool check(int strip_length)
+{
+    const int len = strip_length * 3 / 4;
+    const int words = len * sizeof(T) * 8;
+    std::vector<uint32_t> in(words);
+    std::vector<uint32_t> expected(words, 0xDEADBEEF);
+    std::vector<uint32_t> actual(words, 0xDEADBEEF);
+
+    for (auto& w : in) {
+        w = (std::rand() << 16) ^ std::rand();
+    }
+
+    remap_bits_reference<T>(in.data(), expected.data(), len, 0, len);
+    remap_bits<T>(in.data(), actual.data(), len, 0, len);
+    if (expected != actual) {
+        return false;
+    }
+
+    // Columns outside of [begin, end) are left untouched
+    const int begin = len / 3, end = len - len / 4;
+    std::fill(expected.begin(), expected.end(), 0);
+    std::fill(actual.begin(), actual.end(), 0);
+    remap_bits_reference<T>(in.data(), expected.data(), len, begin, end);
+    remap_bits<T>(in.data(), actual.data(), len, begin, end);
+    return expected == actual;
+}
+
+template <typename T>
+static double run(kernel k, int strip_length)
+{
+    const int len = strip_length * 3 / 4;
+    const int words = len * sizeof(T) * 8;
+    const int frames = 2000;
+    std::vector<uint32_t> in(words);
+    std::vector<uint32_t> out(words);
+    uint32_t sum = 0;
+
+    for (auto& w : in) {
+        w = std::rand();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; f++) {
+        in[f % words] ^= f;
+        k(in.data(), out.data(), len, 0, len);
+        sum += out[f % words];
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    // Keep the compiler from optimizing the loop away
+    if (sum == 0x12345678) {
+        std::printf(" ");
+    }
+
+    return std::chrono::duration<double, std::micro>(elapsed).count() / frames;
+}
+
+template <typename T>
+static bool bench(int strip_length)
+{
+    const int strip_count = sizeof(T) * 8;
+
+    for (int l = 4; l <= 512; l += 4) {
+        if (!check<T>(l)) {
+            std::printf("%2d strips of %d LEDs: output differs from the reference\n", strip_count, l);
+            return false;
+        }
+    }
+
+    double reference = run<T>(remap_bits_reference<T>, strip_length);
+    double vectorized = run<T>(remap_bits<T>, strip_length);
+    std::printf("%2d strips of %d LEDs: reference %8.2f us, vectorized %8.2f us (x%.1f)\n",
+        strip_count, strip_length, reference, vectorized, reference / vectorized);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const int strip_length = argc > 1 ? std::atoi(argv[1]) : 64;
+
+#if defined(EPILEPSIA_BIT_TRANSPOSE_NEON)
+    std::printf("Kernel: NEON\n");
+#elif defined(EPILEPSIA_BIT_TRANSPOSE_SSE2)
+    std::printf("Kernel: SSE2\n");
+#else
+    std::printf("Kernel: reference\n");
+#endif
+
+    bool ok = bench<uint8_t>(strip_length) && bench<uint16_t>(strip_length) && bench<uint32_t>(strip_length);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Websocket payload unmasking throughput, byte by byte versus websocket_unmask().
+ */
+
+#include "websocket.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace epilepsia;
+
+static void unmask_bytes(uint8_t* data, size_t len, const uint8_t* key)
+{
+    for (size_t i = 0; i < len; i++) {
+        data[i] = data[i] ^ key[i % 4];
+    }
+}
+
+template <typename F>
+static double throughput(F&& unmask, size_t len)
+{
+    // The payload starts after the OPC header, buffer + 2 is as unaligned as it gets
+    std::vector<uint8_t> buffer(len + 16);
+    uint8_t* data = buffer.data() + 2;
+    const size_t bytes = 256 << 20;
+    const size_t iterations = bytes / len;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        unmask(data, len);
+        // Keep the compiler from skipping the work
+        asm volatile("" : : "r"(data) : "memory");
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return iterations * len / elapsed.count() / 1e6;
+}
+
+int main()
+{
+    const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+    // Check the result against the reference, for every alignment and phase
+    std::vector<uint8_t> a(300), b(300);
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t phase = 0; phase < 4; phase++) {
+            for (size_t i = 0; i < a.size(); i++) {
+                a[i] = b[i] = std::rand();
+            }
+            uint8_t rotated[4];
+            for (size_t j = 0; j < 4; j++) {
+                rotated[j] = key[(phase + j) & 3];
+            }
+            unmask_bytes(&a[offset], 250, rotated);
+            websocket_unmask(&b[offset], 250, key, phase);
+            if (a != b) {
+                std::printf("Mismatch, offset %zu phase %zu\n", offset, phase);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    std::printf("%10s %14s %14s\n", "bytes", "bytes MB/s", "unmask MB/s");
+    for (size_t len : { 126, 1024, 5760, 11520, 65535 }) {
+        double reference = throughput([&](uint8_t* d, size_t l) { unmask_bytes(d, l, key); }, len);
+        double optimized = throughput([&](uint8_t* d, size_t l) { websocket_unmask(d, l, key); }, len);
+        std::printf("%10zu %14.1f %14.1f\n", len, reference, optimized);
+    }
+
+    return EXIT_SUCCESS;
+}
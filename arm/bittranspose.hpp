@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIABITTRANSPOSE_H
+#define EPILEPSIABITTRANSPOSE_H
+
+#include <cstdint>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define EPILEPSIA_BIT_TRANSPOSE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define EPILEPSIA_BIT_TRANSPOSE_SSE2
+#endif
+
+namespace epilepsia {
+
+/**
+ * Interleave the bits of sizeof(T) * 8 strips the way the PRUs shift them out.
+ *
+ * in holds the GRB bytes of every strip one after the other, len 32 bits
+ * words per strip. The 4 bytes of column i (in[i], in[i + len]...) end up in
+ * 32 words of type T starting at out[i * 32]: one word per byte and bit,
+ * most significant bit first, with strip k at bit sizeof(T) * 8 - 1 - k.
+ * Only columns [begin, end) are written.
+ *
+ * Bit by bit version, kept as a reference for the vectorized one.
+ */
+template <typename T>
+void remap_bits_reference(const uint32_t* in, uint32_t* out, const int len, const int begin, const int end)
+{
+    constexpr const uint32_t mask = sizeof(T) == 4 ? 0x00000001 : sizeof(T) == 2 ? 0x00010001 : 0x01010101;
+
+    for (auto i = begin, ii = begin * 32; i < end; i++, ii += 32) {
+        for (size_t l = 0; l < sizeof(T) * 8; l += 8) {
+            for (auto j = 0; j < 8; j++) {
+                uint32_t m = 0;
+                for (size_t k = 0, kk = 0; k < sizeof(T) * 8; k++, kk += len) {
+                    uint32_t n = in[i + kk];
+                    m |= (((n >> (7 + l - j)) & mask) << (sizeof(T) * 8 - 1 - k));
+                }
+                for (size_t k = 0; k < 32; k += sizeof(T) * 8) {
+                    reinterpret_cast<T*>(out)[ii + j + l + k] = (m >> k) & static_cast<T>(0xFFFFFFFF);
+                }
+            }
+        }
+    }
+}
+
+#if defined(EPILEPSIA_BIT_TRANSPOSE_NEON) || defined(EPILEPSIA_BIT_TRANSPOSE_SSE2)
+
+/*
+ * Same output as remap_bits_reference, 8x8 bit blocks at a time.
+ *
+ * A column is cut in blocks of 8 strips: the same byte of 8 strips, packed
+ * in a 64 bits lane with strip 0 in the last byte, is an 8x8 bit matrix.
+ * Once transposed (Hacker's Delight, 3 rounds of masked swaps), byte 7 - j
+ * holds bit 7 - j of the 8 strips, strip 0 first. Reversing the bytes and
+ * interleaving the blocks gives the 8, 16 or 32 bits words of the PRUs.
+ * Two blocks are transposed per 128 bits register.
+ */
+#if defined(EPILEPSIA_BIT_TRANSPOSE_NEON)
+
+namespace detail {
+
+inline uint8x16_t transpose_8x8(uint8x16_t v)
+{
+    uint64x2_t x = vreinterpretq_u64_u8(v);
+    uint64x2_t t;
+
+    t = vandq_u64(veorq_u64(x, vshrq_n_u64(x, 7)), vdupq_n_u64(0x00AA00AA00AA00AAull));
+    x = veorq_u64(x, veorq_u64(t, vshlq_n_u64(t, 7)));
+    t = vandq_u64(veorq_u64(x, vshrq_n_u64(x, 14)), vdupq_n_u64(0x0000CCCC0000CCCCull));
+    x = veorq_u64(x, veorq_u64(t, vshlq_n_u64(t, 14)));
+    t = vandq_u64(veorq_u64(x, vshrq_n_u64(x, 28)), vdupq_n_u64(0x00000000F0F0F0F0ull));
+    x = veorq_u64(x, veorq_u64(t, vshlq_n_u64(t, 28)));
+
+    // Bit 7 - j of the strips in byte j
+    return vrev64q_u8(vreinterpretq_u8_u64(x));
+}
+
+// Transposed blocks of strips 8 * g to 8 * g + 7: bytes 0 and 1, bytes 2 and 3
+inline void transpose_block(const uint32_t* in, const int len, uint8x16_t& low, uint8x16_t& high)
+{
+    uint32_t w[8];
+    for (int k = 0; k < 8; k++) {
+        w[7 - k] = in[k * len];
+    }
+
+    // val[b] = byte b of the 8 strips, strip 0 last
+    uint8x8x4_t v = vld4_u8(reinterpret_cast<const uint8_t*>(w));
+    low = transpose_8x8(vcombine_u8(v.val[0], v.val[1]));
+    high = transpose_8x8(vcombine_u8(v.val[2], v.val[3]));
+}
+
+template <typename T>
+inline void remap_column(const uint32_t* in, uint8_t* out, const int len);
+
+template <>
+inline void remap_column<uint8_t>(const uint32_t* in, uint8_t* out, const int len)
+{
+    uint8x16_t b01, b23;
+    transpose_block(in, len, b01, b23);
+    vst1q_u8(out, b01);
+    vst1q_u8(out + 16, b23);
+}
+
+template <>
+inline void remap_column<uint16_t>(const uint32_t* in, uint8_t* out, const int len)
+{
+    uint8x16_t b[2][2];
+    for (int g = 0; g < 2; g++) {
+        transpose_block(in + g * 8 * len, len, b[g][0], b[g][1]);
+    }
+
+    // Strips 0-7 in the high byte
+    for (int h = 0; h < 2; h++) {
+        uint8x16x2_t z = vzipq_u8(b[1][h], b[0][h]);
+        vst1q_u8(out + h * 32, z.val[0]);
+        vst1q_u8(out + h * 32 + 16, z.val[1]);
+    }
+}
+
+template <>
+inline void remap_column<uint32_t>(const uint32_t* in, uint8_t* out, const int len)
+{
+    uint8x16_t b[4][2];
+    for (int g = 0; g < 4; g++) {
+        transpose_block(in + g * 8 * len, len, b[g][0], b[g][1]);
+    }
+
+    // Strips 0-7 in the most significant byte
+    for (int h = 0; h < 2; h++) {
+        uint8x16x2_t lo = vzipq_u8(b[3][h], b[2][h]);
+        uint8x16x2_t hi = vzipq_u8(b[1][h], b[0][h]);
+        for (int i = 0; i < 2; i++) {
+            uint16x8x2_t z = vzipq_u16(vreinterpretq_u16_u8(lo.val[i]), vreinterpretq_u16_u8(hi.val[i]));
+            vst1q_u8(out + h * 64 + i * 32, vreinterpretq_u8_u16(z.val[0]));
+            vst1q_u8(out + h * 64 + i * 32 + 16, vreinterpretq_u8_u16(z.val[1]));
+        }
+    }
+}
+
+} // namespace detail
+
+#else
+
+namespace detail {
+
+inline __m128i transpose_8x8(__m128i x)
+{
+    __m128i t;
+
+    t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 7)), _mm_set1_epi64x(0x00AA00AA00AA00AAll));
+    x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 7)));
+    t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 14)), _mm_set1_epi64x(0x0000CCCC0000CCCCll));
+    x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 14)));
+    t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 28)), _mm_set1_epi64x(0x00000000F0F0F0F0ll));
+    x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 28)));
+
+    // Bit 7 - j of the strips in byte j: swap the bytes of each 16 bits word,
+    // then reverse the words of each 64 bits lane
+    x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0x1B), 0x1B);
+}
+
+// 4x4 byte transpose, byte b of the 4 words in word b
+inline __m128i transpose_4x4(__m128i x)
+{
+    x = _mm_unpacklo_epi8(x, _mm_srli_si128(x, 8));
+    return _mm_unpacklo_epi8(x, _mm_srli_si128(x, 8));
+}
+
+// Transposed blocks of strips 8 * g to 8 * g + 7: bytes 0 and 1, bytes 2 and 3
+inline void transpose_block(const uint32_t* in, const int len, __m128i& low, __m128i& high)
+{
+    __m128i a = transpose_4x4(_mm_setr_epi32(in[7 * len], in[6 * len], in[5 * len], in[4 * len]));
+    __m128i b = transpose_4x4(_mm_setr_epi32(in[3 * len], in[2 * len], in[len], in[0]));
+
+    // 64 bits lanes of byte b of the 8 strips, strip 0 last
+    low = transpose_8x8(_mm_unpacklo_epi32(a, b));
+    high = transpose_8x8(_mm_unpackhi_epi32(a, b));
+}
+
+inline void store(uint8_t* out, __m128i x)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), x);
+}
+
+template <typename T>
+inline void remap_column(const uint32_t* in, uint8_t* out, const int len);
+
+template <>
+inline void remap_column<uint8_t>(const uint32_t* in, uint8_t* out, const int len)
+{
+    __m128i b01, b23;
+    transpose_block(in, len, b01, b23);
+    store(out, b01);
+    store(out + 16, b23);
+}
+
+template <>
+inline void remap_column<uint16_t>(const uint32_t* in, uint8_t* out, const int len)
+{
+    __m128i b[2][2];
+    for (int g = 0; g < 2; g++) {
+        transpose_block(in + g * 8 * len, len, b[g][0], b[g][1]);
+    }
+
+    // Strips 0-7 in the high byte
+    for (int h = 0; h < 2; h++) {
+        store(out + h * 32, _mm_unpacklo_epi8(b[1][h], b[0][h]));
+        store(out + h * 32 + 16, _mm_unpackhi_epi8(b[1][h], b[0][h]));
+    }
+}
+
+template <>
+inline void remap_column<uint32_t>(const uint32_t* in, uint8_t* out, const int len)
+{
+    __m128i b[4][2];
+    for (int g = 0; g < 4; g++) {
+        transpose_block(in + g * 8 * len, len, b[g][0], b[g][1]);
+    }
+
+    // Strips 0-7 in the most significant byte
+    for (int h = 0; h < 2; h++) {
+        __m128i lo[2] = { _mm_unpacklo_epi8(b[3][h], b[2][h]), _mm_unpackhi_epi8(b[3][h], b[2][h]) };
+        __m128i hi[2] = { _mm_unpacklo_epi8(b[1][h], b[0][h]), _mm_unpackhi_epi8(b[1][h], b[0][h]) };
+        for (int i = 0; i < 2; i++) {
+            store(out + h * 64 + i * 32, _mm_unpacklo_epi16(lo[i], hi[i]));
+            store(out + h * 64 + i * 32 + 16, _mm_unpackhi_epi16(lo[i], hi[i]));
+        }
+    }
+}
+
+} // namespace detail
+
+#endif
+
+template <typename T>
+void remap_bits(const uint32_t* in, uint32_t* out, const int len, const int begin, const int end)
+{
+    for (auto i = begin; i < end; i++) {
+        detail::remap_column<T>(in + i, reinterpret_cast<uint8_t*>(out + i * sizeof(T) * 8), len);
+    }
+}
+
+#else
+
+template <typename T>
+void remap_bits(const uint32_t* in, uint32_t* out, const int len, const int begin, const int end)
+{
+    remap_bits_reference<T>(in, out, len, begin, end);
+}
+
+#endif
+
+} // namespace epilepsia
+
+#endif // EPILEPSIABITTRANSPOSE_H
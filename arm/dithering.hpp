@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIADITHERING_H
+#define EPILEPSIADITHERING_H
+
+#include <cstdint>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define EPILEPSIA_DITHERING_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define EPILEPSIA_DITHERING_SSE2
+#endif
+
+namespace epilepsia {
+
+/**
+ * Temporal dithering of a 16 bit level d to the 8 bits shifted out to the
+ * LEDs, the error is carried over to the next frame in residual.
+ * Starting from 0, residual stays between -383 and 127.
+ */
+inline uint8_t dither(int d, int16_t& residual)
+{
+    // Compiles to a single usat ARM instruction
+    auto usat = [](int a) {
+        return a > 65535 ? 65535 : a < 0 ? 0 : a;
+    };
+
+    d += residual;
+    int e = usat(d + 0x80) >> 8;
+    residual = d - (e * 257);
+    return e;
+}
+
+/**
+ * Gamma correct and dither n bytes of GRB channels in place, through a LUT
+ * of 16 bit levels. The bytes sent are added to level, G, R and B.
+ *
+ * One byte at a time version, kept as a reference for the vectorized one.
+ */
+inline void dither_bytes_reference(uint8_t* buffer, const uint16_t* lut, int16_t* residual, const int n, int* level)
+{
+    for (auto i = 0; i < n; i++) {
+        level[i % 3] += buffer[i] = dither(lut[buffer[i]], residual[i]);
+    }
+}
+
+#if defined(EPILEPSIA_DITHERING_NEON) || defined(EPILEPSIA_DITHERING_SSE2)
+
+/*
+ * Same output as dither_bytes_reference, 8 bytes at a time.
+ *
+ * The LUT lookups stay scalar, everything else fits 16 bits lanes: with
+ * d + 0x80 = 256 * h + s, h the high byte of the level, s between -255 and
+ * 510, the byte sent is h + (s >> 8) saturated to 8 bits. The new residual
+ * is small enough that computing it modulo 2^16 gives the exact value.
+ */
+namespace detail {
+
+#if defined(EPILEPSIA_DITHERING_NEON)
+
+using accumulator = uint16x8_t;
+
+inline accumulator zero()
+{
+    return vdupq_n_u16(0);
+}
+
+inline uint16x8_t lookup(const uint8_t* buffer, const uint16_t* lut)
+{
+    uint16x8_t x = vdupq_n_u16(0);
+    x = vld1q_lane_u16(lut + buffer[0], x, 0);
+    x = vld1q_lane_u16(lut + buffer[1], x, 1);
+    x = vld1q_lane_u16(lut + buffer[2], x, 2);
+    x = vld1q_lane_u16(lut + buffer[3], x, 3);
+    x = vld1q_lane_u16(lut + buffer[4], x, 4);
+    x = vld1q_lane_u16(lut + buffer[5], x, 5);
+    x = vld1q_lane_u16(lut + buffer[6], x, 6);
+    x = vld1q_lane_u16(lut + buffer[7], x, 7);
+    return x;
+}
+
+inline uint16x8_t load(const uint16_t* in)
+{
+    return vld1q_u16(in);
+}
+
+inline void dither_lanes(uint16x8_t x, uint8_t* out, int16_t* residual, accumulator& sum)
+{
+    const int16x8_t r = vld1q_s16(residual);
+    const int16x8_t h = vreinterpretq_s16_u16(vshrq_n_u16(x, 8));
+    const int16x8_t s = vaddq_s16(vreinterpretq_s16_u16(vandq_u16(x, vdupq_n_u16(0xFF))), vaddq_s16(r, vdupq_n_s16(0x80)));
+    const uint8x8_t e = vqmovun_s16(vsraq_n_s16(h, s, 8));
+
+    const int16x8_t d = vaddq_s16(vreinterpretq_s16_u16(x), r);
+    vst1q_s16(residual, vmlsq_n_s16(d, vreinterpretq_s16_u16(vmovl_u8(e)), 257));
+    vst1_u8(out, e);
+    sum = vaddw_u8(sum, e);
+}
+
+// Lane j of a holds bytes of channel (phase + j) % 3
+inline void fold(accumulator a, int phase, int* level)
+{
+    uint16_t lanes[8];
+    vst1q_u16(lanes, a);
+    for (auto j = 0; j < 8; j++) {
+        level[(phase + j) % 3] += lanes[j];
+    }
+}
+
+#else
+
+using accumulator = __m128i;
+
+inline accumulator zero()
+{
+    return _mm_setzero_si128();
+}
+
+inline __m128i lookup(const uint8_t* buffer, const uint16_t* lut)
+{
+    return _mm_setr_epi16(lut[buffer[0]], lut[buffer[1]], lut[buffer[2]], lut[buffer[3]],
+        lut[buffer[4]], lut[buffer[5]], lut[buffer[6]], lut[buffer[7]]);
+}
+
+inline __m128i load(const uint16_t* in)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+}
+
+inline void dither_lanes(__m128i x, uint8_t* out, int16_t* residual, accumulator& sum)
+{
+    const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(residual));
+    const __m128i h = _mm_srli_epi16(x, 8);
+    const __m128i s = _mm_add_epi16(_mm_and_si128(x, _mm_set1_epi16(0xFF)), _mm_add_epi16(r, _mm_set1_epi16(0x80)));
+    const __m128i e = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(h, _mm_srai_epi16(s, 8)), _mm_setzero_si128()), _mm_set1_epi16(0xFF));
+
+    const __m128i d = _mm_add_epi16(x, r);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(residual), _mm_sub_epi16(d, _mm_mullo_epi16(e, _mm_set1_epi16(257))));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(e, e));
+    sum = _mm_add_epi16(sum, e);
+}
+
+// Lane j of a holds bytes of channel (phase + j) % 3
+inline void fold(accumulator a, int phase, int* level)
+{
+    alignas(16) uint16_t lanes[8];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), a);
+    for (auto j = 0; j < 8; j++) {
+        level[(phase + j) % 3] += lanes[j];
+    }
+}
+
+#endif
+
+// Levels of 8 bytes at a time, then of the remaining ones one by one. The
+// sums of the lanes stay on 16 bits: n must not exceed 6144
+template <typename Vector, typename Scalar>
+inline void dither_run(uint8_t* out, int16_t* residual, const int n, int* level, Vector vector, Scalar scalar)
+{
+    // Groups of 8 bytes start on channel 0, 2 and 1 in turn
+    accumulator a0 = zero(), a1 = zero(), a2 = zero();
+    auto i = 0;
+    for (; i + 24 <= n; i += 24) {
+        dither_lanes(vector(i), out + i, residual + i, a0);
+        dither_lanes(vector(i + 8), out + i + 8, residual + i + 8, a2);
+        dither_lanes(vector(i + 16), out + i + 16, residual + i + 16, a1);
+    }
+    if (i + 8 <= n) {
+        dither_lanes(vector(i), out + i, residual + i, a0);
+        i += 8;
+    }
+    if (i + 8 <= n) {
+        dither_lanes(vector(i), out + i, residual + i, a2);
+        i += 8;
+    }
+
+    fold(a0, 0, level);
+    fold(a1, 1, level);
+    fold(a2, 2, level);
+
+    for (; i < n; i++) {
+        level[i % 3] += out[i] = dither(scalar(i), residual[i]);
+    }
+}
+
+} // namespace detail
+
+inline void dither_bytes(uint8_t* buffer, const uint16_t* lut, int16_t* residual, const int n, int* level)
+{
+    detail::dither_run(buffer, residual, n, level,
+        [=](int i) { return detail::lookup(buffer + i, lut); },
+        [=](int i) { return lut[buffer[i]]; });
+}
+
+// Same as dither_bytes, for levels already gamma corrected: in[i] to out[i]
+inline void dither_levels(const uint16_t* in, uint8_t* out, int16_t* residual, const int n, int* level)
+{
+    detail::dither_run(out, residual, n, level,
+        [=](int i) { return detail::load(in + i); },
+        [=](int i) { return in[i]; });
+}
+
+#else
+
+inline void dither_bytes(uint8_t* buffer, const uint16_t* lut, int16_t* residual, const int n, int* level)
+{
+    dither_bytes_reference(buffer, lut, residual, n, level);
+}
+
+inline void dither_levels(const uint16_t* in, uint8_t* out, int16_t* residual, const int n, int* level)
+{
+    for (auto i = 0; i < n; i++) {
+        level[i % 3] += out[i] = dither(in[i], residual[i]);
+    }
+}
+
+#endif
+
+} // namespace epilepsia
+
+#endif // EPILEPSIADITHERING_H
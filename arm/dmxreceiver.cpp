@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dmxreceiver.hpp"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace epilepsia {
+
+namespace {
+
+    constexpr uint16_t e131_port = 5568;
+    constexpr uint16_t artnet_port = 6454;
+
+    const uint8_t e131_identifier[] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+    const uint8_t artnet_identifier[] = { 'A', 'r', 't', '-', 'N', 'e', 't', 0 };
+
+    constexpr uint32_t e131_root_data = 0x00000004;
+    constexpr uint32_t e131_root_extended = 0x00000008;
+    constexpr uint32_t e131_frame_data = 0x00000002;
+    constexpr uint32_t e131_frame_sync = 0x00000001;
+
+    constexpr uint16_t artnet_op_dmx = 0x5000;
+    constexpr uint16_t artnet_op_sync = 0x5200;
+
+    // Art-Net nodes fall back to unsynchronized mode after 4 s without ArtSync
+    constexpr auto artnet_sync_timeout = std::chrono::seconds(4);
+
+    // E131_NETWORK_DATA_LOSS_TIMEOUT, after which E1.31 receivers stop
+    // waiting for synchronization packets (section 6.2.4.1)
+    constexpr auto e131_sync_timeout = std::chrono::milliseconds(2500);
+
+    inline uint16_t be16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+    inline uint32_t be32(const uint8_t* p) { return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+    // Options of an E1.31 data packet (section 6.2.6)
+    constexpr uint8_t e131_option_preview = 0x80;
+    constexpr uint8_t e131_option_terminated = 0x40;
+
+} // namespace
+
+bool parse_e131_data(const uint8_t* packet, size_t len, e131_data& data)
+{
+    if (len < 126 || !std::equal(std::begin(e131_identifier), std::end(e131_identifier), packet + 4)
+        || be32(packet + 18) != e131_root_data || be32(packet + 40) != e131_frame_data) {
+        return false;
+    }
+
+    uint16_t count = be16(packet + 123);
+    uint8_t start_code = packet[125];
+    if (start_code != 0 || count < 1) {
+        return false;
+    }
+
+    uint8_t options = packet[112];
+    data.sync_address = be16(packet + 109);
+    data.sequence = packet[111];
+    data.preview = options & e131_option_preview;
+    data.terminated = options & e131_option_terminated;
+    data.universe = be16(packet + 113);
+    data.channels = packet + 126;
+    data.count = std::min<size_t>(count - 1, len - 126);
+    return true;
+}
+
+dmx_receiver::dmx_receiver(const dmx_settings& settings, const led_driver_settings& driver)
+    : settings_(settings)
+    , frame_(driver.strip_length * driver.strip_count * 3, 0)
+{
+    for (auto& u : settings_.universes) {
+        if (u.strip < 0 || u.strip >= driver.strip_count || u.pixel < 0 || u.pixel >= driver.strip_length) {
+            spdlog::warn("Universe {} is mapped outside of the display, ignoring it", u.universe);
+            continue;
+        }
+        if (universe_index_.count(u.universe)) {
+            spdlog::warn("Universe {} is mapped more than once, ignoring it", u.universe);
+            continue;
+        }
+
+        universe_state state;
+        state.mapping = u;
+        state.offset = (u.strip * driver.strip_length + u.pixel) * 3;
+        state.length = std::min({ u.count, driver.strip_length - u.pixel, 170 }) * 3;
+
+        universe_index_.emplace(u.universe, universes_.size());
+        universes_.push_back(state);
+    }
+
+    received_.resize(universes_.size(), false);
+}
+
+bool dmx_receiver::start()
+{
+    if (!running_) {
+        if ((!settings_.e131 && !settings_.artnet) || universes_.empty()) {
+            return true;
+        }
+        if (listen()) {
+            running_ = true;
+            thread_ = std::thread(&dmx_receiver::run, this);
+            return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+void dmx_receiver::stop()
+{
+    if (running_) {
+        running_ = false;
+
+        uint64_t one = 1;
+        if (::write(wake_fd_, &one, sizeof(one)) < 0) {
+            spdlog::warn("Could not wake up the DMX thread: {}", strerror(errno));
+        }
+        thread_.join();
+        close_sockets();
+    }
+}
+
+bool dmx_receiver::listen()
+{
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ < 0) {
+        spdlog::error("Could not create eventfd: {}", strerror(errno));
+        return false;
+    }
+
+    if (settings_.e131) {
+        e131_sock_ = bind_socket(e131_port);
+        if (e131_sock_ < 0) {
+            close_sockets();
+            return false;
+        }
+
+        for (auto& u : universes_) {
+            join_universe(u.mapping.universe, true);
+        }
+        spdlog::info("Listening for E1.31 on port {}", e131_port);
+    }
+
+    if (settings_.artnet) {
+        artnet_sock_ = bind_socket(artnet_port);
+        if (artnet_sock_ < 0) {
+            close_sockets();
+            return false;
+        }
+        spdlog::info("Listening for Art-Net on port {}", artnet_port);
+    }
+
+    return true;
+}
+
+int dmx_receiver::bind_socket(uint16_t port)
+{
+    sockaddr_in address;
+    int one = 1;
+
+    int sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        spdlog::error("Could not create socket: {}", strerror(errno));
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(sock, (sockaddr*)&address, sizeof(address)) != 0) {
+        spdlog::error("Could not bind to port {}", port);
+        ::close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+bool dmx_receiver::join_universe(uint16_t universe, bool join)
+{
+    // sACN universes are multicast to 239.255.<universe high>.<universe low>
+    ip_mreq mreq{};
+    mreq.imr_multiaddr.s_addr = htonl(0xEFFF0000 | universe);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(e131_sock_, IPPROTO_IP, join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+        spdlog::warn("Could not {} multicast group of universe {}: {}", join ? "join" : "leave", universe, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void dmx_receiver::close_sockets()
+{
+    for (int* fd : { &e131_sock_, &artnet_sock_, &wake_fd_ }) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void dmx_receiver::run()
+{
+    uint8_t buffer[1024];
+    pollfd fds[] = {
+        { wake_fd_, POLLIN, 0 },
+        { e131_sock_, POLLIN, 0 },
+        { artnet_sock_, POLLIN, 0 }
+    };
+
+    while (running_) {
+        int timeout = -1;
+        if (holding_) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(sync_deadline_ - std::chrono::steady_clock::now());
+            timeout = std::max<int>(0, left.count());
+        }
+
+        // Negative descriptors are ignored by poll
+        int ready = poll(fds, 3, timeout);
+        if (ready == 0) {
+            // The sync packet did not come, present the frame anyway
+            commit();
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        for (int i = 1; i < 3; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            ssize_t len;
+            while ((len = recv(fds[i].fd, buffer, sizeof(buffer), 0)) > 0) {
+                if (fds[i].fd == e131_sock_) {
+                    handle_e131(buffer, len);
+                } else {
+                    handle_artnet(buffer, len);
+                }
+            }
+        }
+    }
+}
+
+void dmx_receiver::handle_e131(const uint8_t* packet, size_t len)
+{
+    if (len < 49 || !std::equal(std::begin(e131_identifier), std::end(e131_identifier), packet + 4)) {
+        return;
+    }
+
+    uint32_t root_vector = be32(packet + 18);
+    uint32_t frame_vector = be32(packet + 40);
+
+    if (root_vector == e131_root_extended && frame_vector == e131_frame_sync) {
+        // Synchronization packet: present the frame if it is the one our universes wait for
+        if (e131_sync_address_ != 0 && be16(packet + 45) == e131_sync_address_) {
+            e131_sync_ = std::chrono::steady_clock::now();
+            commit();
+        }
+        return;
+    }
+
+    e131_data data;
+    if (!parse_e131_data(packet, len, data)) {
+        return;
+    }
+
+    if (data.terminated) {
+        forget_e131_source(data);
+        return;
+    }
+
+    // Preview data is not meant for the LEDs
+    if (data.preview) {
+        return;
+    }
+
+    const uint16_t universe = data.universe;
+    const uint16_t sync_address = data.sync_address;
+
+    if (sync_address != e131_sync_address_ && universe_index_.count(universe)) {
+        // The sync packets of a multicast source go to the group of their own universe
+        if (e131_sync_address_ != 0 && !universe_index_.count(e131_sync_address_)) {
+            join_universe(e131_sync_address_, false);
+        }
+        if (sync_address != 0 && !universe_index_.count(sync_address)) {
+            join_universe(sync_address, true);
+        }
+        e131_sync_address_ = sync_address;
+    }
+
+    // Until sync packets arrive, or once they stopped, frames are presented
+    // as soon as they are complete
+    auto now = std::chrono::steady_clock::now();
+    bool synchronized = sync_address != 0 && now - e131_sync_ < e131_sync_timeout;
+    if (synchronized) {
+        sync_deadline_ = e131_sync_ + e131_sync_timeout;
+    }
+
+    handle_dmx(universe, data.sequence, true, data.channels, data.count, synchronized);
+}
+
+void dmx_receiver::forget_e131_source(const e131_data& data)
+{
+    auto it = universe_index_.find(data.universe);
+    if (it == universe_index_.end()) {
+        return;
+    }
+    spdlog::info("E1.31 source of universe {} terminated its stream", data.universe);
+
+    // The next source starts with its own sequence numbers
+    universes_[it->second].has_sequence = false;
+
+    // and may not be synchronized: stop waiting for the sync packets of this one
+    if (data.sync_address != 0 && data.sync_address == e131_sync_address_) {
+        if (!universe_index_.count(e131_sync_address_)) {
+            join_universe(e131_sync_address_, false);
+        }
+        e131_sync_address_ = 0;
+        e131_sync_ = std::chrono::steady_clock::time_point();
+    }
+}
+
+void dmx_receiver::handle_artnet(const uint8_t* packet, size_t len)
+{
+    if (len < 10 || !std::equal(std::begin(artnet_identifier), std::end(artnet_identifier), packet)) {
+        return;
+    }
+
+    uint16_t opcode = packet[8] | (packet[9] << 8);
+    auto now = std::chrono::steady_clock::now();
+
+    if (opcode == artnet_op_sync) {
+        artnet_sync_ = now;
+        commit();
+        return;
+    }
+
+    if (opcode != artnet_op_dmx || len < 18) {
+        return;
+    }
+
+    uint8_t sequence = packet[12];
+    uint16_t universe = packet[14] | ((packet[15] & 0x7F) << 8);
+    size_t channels = std::min<size_t>(be16(packet + 16), len - 18);
+
+    bool synchronized = now - artnet_sync_ < artnet_sync_timeout;
+    if (synchronized) {
+        sync_deadline_ = artnet_sync_ + artnet_sync_timeout;
+    }
+
+    // A sequence number of 0 means that sequencing is disabled
+    handle_dmx(universe, sequence, sequence != 0, packet + 18, channels, synchronized);
+}
+
+void dmx_receiver::handle_dmx(uint16_t universe, uint8_t sequence, bool check_sequence,
+    const uint8_t* data, size_t len, bool synchronized)
+{
+    auto it = universe_index_.find(universe);
+    if (it == universe_index_.end()) {
+        return;
+    }
+
+    size_t index = it->second;
+    auto& u = universes_[index];
+
+    if (check_sequence) {
+        // Out of order packet, as defined in E1.31 section 6.7.2
+        auto delta = static_cast<int8_t>(sequence - u.sequence);
+        if (u.has_sequence && delta <= 0 && delta > -20) {
+            return;
+        }
+        u.sequence = sequence;
+        u.has_sequence = true;
+    }
+
+    // Without synchronization, a universe received twice means that
+    // the source moved on to the next frame
+    if (!synchronized && received_[index]) {
+        commit();
+    }
+
+    std::copy_n(data, std::min<size_t>(len, u.length), frame_.begin() + u.offset);
+
+    if (!received_[index]) {
+        received_[index] = true;
+        received_count_++;
+    }
+    holding_ = holding_ || synchronized;
+
+    if (!synchronized && received_count_ == universes_.size()) {
+        commit();
+    }
+}
+
+void dmx_receiver::commit()
+{
+    if (received_count_ == 0) {
+        return;
+    }
+
+    if (handler_) {
+        handler_(frame_.data(), frame_.size());
+    }
+
+    std::fill(received_.begin(), received_.end(), false);
+    received_count_ = 0;
+    holding_ = false;
+}
+
+} // namespace epilepsia
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIADMXRECEIVER_H
+#define EPILEPSIADMXRECEIVER_H
+
+#include "leddriver.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace epilepsia {
+
+/**
+ * Maps the RGB channels of a DMX universe onto a range of pixels of a strip.
+ */
+struct dmx_universe {
+    uint16_t universe;
+    int strip;
+    int pixel;
+    int count;
+};
+
+struct dmx_settings {
+    bool e131{ false };
+    bool artnet{ false };
+    std::vector<dmx_universe> universes;
+};
+
+/**
+ * Fields of an E1.31 data packet (DMP layer, null start code).
+ */
+struct e131_data {
+    uint16_t universe;
+    uint16_t sync_address;
+    uint8_t sequence;
+    // Preview_Data option: meant for visualizers, not for live output
+    bool preview;
+    // Stream_Terminated option: the source stopped sending this universe
+    bool terminated;
+    const uint8_t* channels;
+    size_t count;
+};
+
+/**
+ * Parse an E1.31 data packet. Returns false for other packets, including
+ * the ones with a non-null start code.
+ */
+bool parse_e131_data(const uint8_t* packet, size_t len, e131_data& data);
+
+/**
+ * E1.31 (sACN) and Art-Net receiver.
+ * Universes are written into a frame buffer which is handed over to the
+ * handler once complete: either when a sync packet is received, or when
+ * all the configured universes have been received if the sources don't
+ * use synchronization. A frame waiting for a sync packet that does not
+ * come is handed over after the timeout of the protocol.
+ */
+class dmx_receiver {
+public:
+    using Handler = std::function<void(const uint8_t*, int)>;
+
+    dmx_receiver(const dmx_settings& settings, const led_driver_settings& driver);
+
+    dmx_receiver(dmx_receiver const&) = delete;
+    dmx_receiver& operator=(dmx_receiver const&) = delete;
+
+    bool start();
+    void stop();
+
+    template <typename T>
+    void set_handler(T&& handler) noexcept
+    {
+        handler_ = handler;
+    }
+
+private:
+    struct universe_state {
+        dmx_universe mapping;
+        int offset;
+        int length;
+        uint8_t sequence{ 0 };
+        bool has_sequence{ false };
+    };
+
+    void run();
+    bool listen();
+    int bind_socket(uint16_t port);
+    bool join_universe(uint16_t universe, bool join);
+    void close_sockets();
+    void handle_e131(const uint8_t* packet, size_t len);
+    void handle_artnet(const uint8_t* packet, size_t len);
+    void forget_e131_source(const e131_data& data);
+    void handle_dmx(uint16_t universe, uint8_t sequence, bool check_sequence,
+        const uint8_t* data, size_t len, bool synchronized);
+    void commit();
+
+    const dmx_settings settings_;
+    std::vector<uint8_t> frame_;
+    std::vector<universe_state> universes_;
+    std::unordered_map<uint16_t, size_t> universe_index_;
+    std::vector<bool> received_;
+    size_t received_count_{ 0 };
+    std::chrono::steady_clock::time_point artnet_sync_;
+
+    // Synchronization universe named by the last E1.31 data packet, its
+    // multicast group is joined when it is not a data universe
+    uint16_t e131_sync_address_{ 0 };
+    std::chrono::steady_clock::time_point e131_sync_;
+
+    // The frame holds synchronized universes, committed at the deadline
+    // if the sync packet never comes
+    bool holding_{ false };
+    std::chrono::steady_clock::time_point sync_deadline_;
+
+    Handler handler_;
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+    int e131_sock_{ -1 };
+    int artnet_sock_{ -1 };
+    int wake_fd_{ -1 };
+};
+
+} // namespace epilepsia
+
+#endif // EPILEPSIADMXRECEIVER_H
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "framecodec.hpp"
+#include <cstring>
+
+namespace epilepsia {
+
+int decode_frame(frame_codec codec, const uint8_t* in, int len, uint8_t* out, int out_size)
+{
+    switch (codec) {
+    case frame_codec::rle:
+        return decode_rle(in, len, out, out_size);
+    case frame_codec::lz4:
+        return decode_lz4(in, len, out, out_size);
+    case frame_codec::qoi:
+        return decode_qoi(in, len, out, out_size);
+    }
+    return -1;
+}
+
+int decode_rle(const uint8_t* in, int len, uint8_t* out, int out_size)
+{
+    const uint8_t* end = in + len;
+    uint8_t* o = out;
+    uint8_t* o_end = out + out_size / 3 * 3;
+
+    while (in < end) {
+        int n = *in++;
+
+        if (n < 128) {
+            // Literal pixels
+            int bytes = (n + 1) * 3;
+            if (end - in < bytes || o_end - o < bytes) {
+                return -1;
+            }
+            std::memcpy(o, in, bytes);
+            in += bytes;
+            o += bytes;
+        } else {
+            // Run of a single pixel
+            int count = n - 127;
+            if (end - in < 3 || o_end - o < count * 3) {
+                return -1;
+            }
+            const uint8_t r = in[0], g = in[1], b = in[2];
+            in += 3;
+            for (int i = 0; i < count; i++, o += 3) {
+                o[0] = r;
+                o[1] = g;
+                o[2] = b;
+            }
+        }
+    }
+
+    return o - out;
+}
+
+int decode_lz4(const uint8_t* in, int len, uint8_t* out, int out_size)
+{
+    const uint8_t* end = in + len;
+    uint8_t* o = out;
+    uint8_t* o_end = out + out_size;
+
+    // Lengths of 15 are followed by extra bytes, 255 means more bytes follow
+    auto read_length = [&](int length) {
+        if (length == 15) {
+            uint8_t b;
+            do {
+                if (in >= end) {
+                    return -1;
+                }
+                b = *in++;
+                length += b;
+            } while (b == 255);
+        }
+        return length;
+    };
+
+    while (in < end) {
+        uint8_t token = *in++;
+
+        int literals = read_length(token >> 4);
+        if (literals < 0 || end - in < literals || o_end - o < literals) {
+            return -1;
+        }
+        std::memcpy(o, in, literals);
+        in += literals;
+        o += literals;
+
+        // The last sequence only has literals
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return -1;
+        }
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        int match = read_length(token & 0x0F);
+        if (match < 0 || offset == 0 || offset > o - out || o_end - o < match + 4) {
+            return -1;
+        }
+        match += 4;
+
+        const uint8_t* m = o - offset;
+        if (offset >= 8) {
+            // No overlap within a 8 bytes chunk
+            uint8_t* stop = o + match;
+            while (stop - o >= 8) {
+                std::memcpy(o, m, 8);
+                o += 8;
+                m += 8;
+            }
+            while (o < stop) {
+                *o++ = *m++;
+            }
+        } else {
+            for (int i = 0; i < match; i++) {
+                *o++ = *m++;
+            }
+        }
+    }
+
+    return o - out;
+}
+
+int decode_qoi(const uint8_t* in, int len, uint8_t* out, int out_size)
+{
+    constexpr int header_size = 14;
+    constexpr int padding_size = 8;
+
+    if (len < header_size + padding_size || std::memcmp(in, "qoif", 4) != 0) {
+        return -1;
+    }
+
+    uint32_t width = (in[4] << 24) | (in[5] << 16) | (in[6] << 8) | in[7];
+    uint32_t height = (in[8] << 24) | (in[9] << 16) | (in[10] << 8) | in[11];
+    uint64_t size = static_cast<uint64_t>(width) * height * 3;
+    int pixels = static_cast<int>(size < static_cast<uint64_t>(out_size) ? size : out_size) / 3;
+
+    uint8_t index[64][4] = {};
+    uint8_t px[4] = { 0, 0, 0, 255 };
+    const uint8_t* p = in + header_size;
+    const uint8_t* end = in + len - padding_size;
+    int run = 0;
+
+    for (int i = 0; i < pixels; i++, out += 3) {
+        if (run > 0) {
+            run--;
+        } else if (p < end) {
+            uint8_t b1 = *p++;
+
+            if (b1 == 0xFE) {
+                // QOI_OP_RGB
+                if (end - p < 3) {
+                    return -1;
+                }
+                px[0] = p[0];
+                px[1] = p[1];
+                px[2] = p[2];
+                p += 3;
+            } else if (b1 == 0xFF) {
+                // QOI_OP_RGBA
+                if (end - p < 4) {
+                    return -1;
+                }
+                std::memcpy(px, p, 4);
+                p += 4;
+            } else if ((b1 & 0xC0) == 0x00) {
+                // QOI_OP_INDEX
+                std::memcpy(px, index[b1], 4);
+            } else if ((b1 & 0xC0) == 0x40) {
+                // QOI_OP_DIFF
+                px[0] += ((b1 >> 4) & 0x03) - 2;
+                px[1] += ((b1 >> 2) & 0x03) - 2;
+                px[2] += (b1 & 0x03) - 2;
+            } else if ((b1 & 0xC0) == 0x80) {
+                // QOI_OP_LUMA
+                if (p >= end) {
+                    return -1;
+                }
+                uint8_t b2 = *p++;
+                int vg = (b1 & 0x3F) - 32;
+                px[0] += vg - 8 + ((b2 >> 4) & 0x0F);
+                px[1] += vg;
+                px[2] += vg - 8 + (b2 & 0x0F);
+            } else {
+                // QOI_OP_RUN
+                run = b1 & 0x3F;
+            }
+
+            std::memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+        } else {
+            return -1;
+        }
+
+        out[0] = px[0];
+        out[1] = px[1];
+        out[2] = px[2];
+    }
+
+    return pixels * 3;
+}
+
+} // namespace epilepsia
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIAFRAMECODEC_H
+#define EPILEPSIAFRAMECODEC_H
+
+#include <cstdint>
+
+namespace epilepsia {
+
+/**
+ * Formats of compressed frames. All of them decode to RGB pixels.
+ *
+ * rle: packets starting with a byte n. If n < 128, n + 1 literal pixels
+ *      follow. Otherwise the next pixel is repeated n - 127 times.
+ * lz4: a raw LZ4 block (no frame header, no size prefix).
+ * qoi: a complete QOI image, alpha is ignored.
+ */
+enum class frame_codec : uint8_t {
+    rle = 0,
+    lz4 = 1,
+    qoi = 2
+};
+
+/**
+ * Decode at most out_size bytes of RGB data to out.
+ * Returns the number of bytes written, or -1 if the input is malformed.
+ */
+int decode_frame(frame_codec codec, const uint8_t* in, int len, uint8_t* out, int out_size);
+
+int decode_rle(const uint8_t* in, int len, uint8_t* out, int out_size);
+int decode_lz4(const uint8_t* in, int len, uint8_t* out, int out_size);
+int decode_qoi(const uint8_t* in, int len, uint8_t* out, int out_size);
+
+} // namespace epilepsia
+
+#endif // EPILEPSIAFRAMECODEC_H
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "framecomposer.hpp"
+#include "framecodec.hpp"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+
+namespace epilepsia {
+
+frame_composer::frame_composer(const frame_composer_settings& settings, const led_driver_settings& driver)
+    : end_of_frame_(settings.end_of_frame)
+    , frame_(driver.strip_length * driver.strip_count * 3, 0)
+    , decoded_(frame_.size())
+{
+    const int bytes_per_strip = driver.strip_length * 3;
+
+    // Without mapping, every channel writes the whole frame
+    for (auto& r : ranges_) {
+        r = { settings.channels.empty() ? 0 : -1, static_cast<int>(frame_.size()) };
+    }
+    ranges_[0] = { 0, static_cast<int>(frame_.size()) };
+
+    for (auto& c : settings.channels) {
+        if (c.channel == 0 || c.strip < 0 || c.strips < 1 || c.strip + c.strips > driver.strip_count) {
+            spdlog::warn("Invalid mapping for channel {}, ignoring it", c.channel);
+            continue;
+        }
+        ranges_[c.channel] = { c.strip * bytes_per_strip, c.strips * bytes_per_strip };
+    }
+
+    std::vector<layer_settings> layers = settings.layers;
+    std::stable_sort(layers.begin(), layers.end(), [](const layer_settings& a, const layer_settings& b) {
+        return a.priority < b.priority;
+    });
+
+    layer_index_.fill(-1);
+    for (auto& l : layers) {
+        const range& r = ranges_[l.channel];
+        if (r.offset < 0 || layer_index_[l.channel] >= 0) {
+            spdlog::warn("Invalid layer for channel {}, ignoring it", l.channel);
+            continue;
+        }
+        layer_index_[l.channel] = layers_.size();
+        layers_.push_back({ l, static_cast<int>(std::min(std::max(l.opacity, 0.0f), 1.0f) * 256 + 0.5f),
+            std::vector<uint8_t>(r.length, 0), clock::time_point(), false });
+    }
+
+    if (!layers_.empty()) {
+        composed_.resize(frame_.size());
+    }
+}
+
+uint8_t* frame_composer::section(uint8_t channel, int& length)
+{
+    const range& r = ranges_[channel];
+
+    // Unmapped channel
+    if (r.offset < 0) {
+        return nullptr;
+    }
+
+    length = r.length;
+    if (layer_index_[channel] < 0) {
+        return frame_.data() + r.offset;
+    }
+
+    return layers_[layer_index_[channel]].pixels.data();
+}
+
+void frame_composer::written(uint8_t channel)
+{
+    if (layer_index_[channel] >= 0) {
+        layer& l = layers_[layer_index_[channel]];
+        l.written = clock::now();
+        l.visible = true;
+    }
+}
+
+namespace {
+
+    // Plain loops on bytes with 16 bits intermediates, left for the compiler to vectorize.
+    // Alpha is in [0, 256], so that an opaque layer replaces what is below exactly.
+
+    void blend_normal(uint8_t* __restrict dst, const uint8_t* __restrict src, int len, int alpha)
+    {
+        for (int i = 0; i < len; i++) {
+            dst[i] = dst[i] + (((src[i] - dst[i]) * alpha) >> 8);
+        }
+    }
+
+    void blend_add(uint8_t* __restrict dst, const uint8_t* __restrict src, int len, int alpha)
+    {
+        for (int i = 0; i < len; i++) {
+            uint16_t v = dst[i] + (static_cast<uint16_t>(src[i] * alpha) >> 8);
+            dst[i] = v > 255 ? 255 : v;
+        }
+    }
+
+    void blend_lighten(uint8_t* __restrict dst, const uint8_t* __restrict src, int len, int alpha)
+    {
+        for (int i = 0; i < len; i++) {
+            uint8_t v = src[i] > dst[i] ? src[i] : dst[i];
+            dst[i] = dst[i] + (static_cast<uint16_t>((v - dst[i]) * alpha) >> 8);
+        }
+    }
+
+} // namespace
+
+const uint8_t* frame_composer::compose()
+{
+    if (layers_.empty()) {
+        return frame_.data();
+    }
+
+    const auto now = clock::now();
+    std::copy(frame_.begin(), frame_.end(), composed_.begin());
+
+    for (auto& l : layers_) {
+        if (!l.visible) {
+            continue;
+        }
+
+        if (l.settings.timeout_ms > 0 && now - l.written >= std::chrono::milliseconds(l.settings.timeout_ms)) {
+            spdlog::debug("Layer of channel {} timed out", l.settings.channel);
+            l.visible = false;
+            continue;
+        }
+
+        uint8_t* dst = composed_.data() + ranges_[l.settings.channel].offset;
+        const int len = l.pixels.size();
+
+        switch (l.settings.blend) {
+        case layer_blend::normal:
+            blend_normal(dst, l.pixels.data(), len, l.alpha);
+            break;
+        case layer_blend::add:
+            blend_add(dst, l.pixels.data(), len, l.alpha);
+            break;
+        case layer_blend::lighten:
+            blend_lighten(dst, l.pixels.data(), len, l.alpha);
+            break;
+        }
+    }
+
+    return composed_.data();
+}
+
+frame_composer::clock::time_point frame_composer::next_timeout() const
+{
+    auto next = clock::time_point::max();
+    for (auto& l : layers_) {
+        if (l.visible && l.settings.timeout_ms > 0) {
+            next = std::min(next, l.written + std::chrono::milliseconds(l.settings.timeout_ms));
+        }
+    }
+    return next;
+}
+
+bool frame_composer::write(uint8_t channel, const uint8_t* pixels, int len)
+{
+    int length;
+    uint8_t* dst = section(channel, length);
+    if (!dst) {
+        return false;
+    }
+
+    std::copy_n(pixels, std::min(len, length), dst);
+    written(channel);
+
+    return !end_of_frame_;
+}
+
+bool frame_composer::write_ranges(uint8_t channel, const uint8_t* data, int len)
+{
+    int section_length;
+    uint8_t* dst = section(channel, section_length);
+    if (!dst) {
+        return false;
+    }
+
+    // Check every range before applying any, a rejected delta leaves the frame as is
+    auto apply = [&](bool copy) {
+        const uint8_t* p = data;
+        int left = len;
+        while (left >= 4) {
+            int offset = (p[0] << 8) | p[1];
+            int length = (p[2] << 8) | p[3];
+            p += 4;
+            left -= 4;
+
+            if (length > left || offset + length > section_length) {
+                return false;
+            }
+
+            if (copy) {
+                std::copy_n(p, length, dst + offset);
+            }
+            p += length;
+            left -= length;
+        }
+        return true;
+    };
+
+    if (!apply(false)) {
+        spdlog::warn("Invalid range in delta frame");
+        return false;
+    }
+    apply(true);
+    written(channel);
+
+    return !end_of_frame_;
+}
+
+bool frame_composer::write_compressed(uint8_t channel, const uint8_t* data, int len)
+{
+    int length;
+    uint8_t* dst = len < 1 ? nullptr : section(channel, length);
+    if (!dst) {
+        return false;
+    }
+
+    // A truncated or malformed frame must not show up half decoded
+    auto codec = static_cast<frame_codec>(data[0]);
+    if (decode_frame(codec, data + 1, len - 1, decoded_.data(), length) != length) {
+        spdlog::warn("Invalid compressed frame");
+        return false;
+    }
+    std::copy_n(decoded_.begin(), length, dst);
+    written(channel);
+
+    return !end_of_frame_;
+}
+
+} // namespace epilepsia
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIAFRAMECOMPOSER_H
+#define EPILEPSIAFRAMECOMPOSER_H
+
+#include "leddriver.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace epilepsia {
+
+/**
+ * Maps an OPC channel onto a range of strips.
+ */
+struct channel_range {
+    uint8_t channel;
+    int strip;
+    int strips;
+};
+
+enum class layer_blend {
+    // Mix with what is below according to the opacity
+    normal,
+    // Saturating add, black is transparent
+    add,
+    // Keep the brightest of the two, black is transparent
+    lighten
+};
+
+/**
+ * Gives a channel its own layer, composited over the base frame.
+ */
+struct layer_settings {
+    uint8_t channel;
+    // Layers with higher priorities are drawn on top
+    int priority{ 0 };
+    float opacity{ 1.0f };
+    layer_blend blend{ layer_blend::normal };
+    // The layer is hidden when not written for that long, 0 to keep it forever
+    int timeout_ms{ 0 };
+};
+
+struct frame_composer_settings {
+    // Wait for an explicit end of frame before committing the frame
+    bool end_of_frame{ false };
+    std::vector<channel_range> channels;
+    std::vector<layer_settings> layers;
+};
+
+/**
+ * Keeps a persistent frame buffer that OPC channels write their section into.
+ * Channel 0 addresses the whole display, as does any channel when no
+ * mapping is configured. Channels configured as layers write into their own
+ * buffer instead, blended over the base frame by compose().
+ */
+class frame_composer {
+public:
+    frame_composer(const frame_composer_settings& settings, const led_driver_settings& driver);
+
+    frame_composer(frame_composer const&) = delete;
+    frame_composer& operator=(frame_composer const&) = delete;
+
+    /**
+     * Write the pixels of a channel in the frame buffer.
+     * Returns true if the frame should be committed now.
+     */
+    bool write(uint8_t channel, const uint8_t* pixels, int len);
+
+    /**
+     * Apply a list of (offset, length, data) ranges to the section of a channel.
+     * Offset and length are big endian 16 bits byte counts.
+     * Returns true if the frame should be committed now.
+     */
+    bool write_ranges(uint8_t channel, const uint8_t* data, int len);
+
+    /**
+     * Decode a compressed frame (see frame_codec) in the section of a channel.
+     * The first byte of data is the codec. The section is left untouched
+     * unless the frame decodes to exactly its size.
+     * Returns true if the frame should be committed now.
+     */
+    bool write_compressed(uint8_t channel, const uint8_t* data, int len);
+
+    /**
+     * Returns the base frame with the active layers blended over it.
+     */
+    const uint8_t* compose();
+    int size() const { return frame_.size(); }
+
+    /**
+     * When the first visible layer times out, time_point::max() if none does.
+     * The frame must be composed again at that time for the layer to disappear.
+     */
+    std::chrono::steady_clock::time_point next_timeout() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct range {
+        int offset{ -1 };
+        int length{ 0 };
+    };
+
+    struct layer {
+        layer_settings settings;
+        // Opacity in 1/256
+        int alpha;
+        std::vector<uint8_t> pixels;
+        clock::time_point written;
+        bool visible{ false };
+    };
+
+    uint8_t* section(uint8_t channel, int& length);
+    // Called once a write succeeded: shows the layer of the channel
+    void written(uint8_t channel);
+
+    const bool end_of_frame_;
+    std::array<range, 256> ranges_;
+    // Index in layers_, or -1 for the base frame
+    std::array<int, 256> layer_index_;
+    std::vector<layer> layers_;
+    std::vector<uint8_t> frame_;
+    std::vector<uint8_t> composed_;
+    // Compressed frames are decoded here, and only copied once complete
+    std::vector<uint8_t> decoded_;
+};
+
+} // namespace epilepsia
+
+#endif // EPILEPSIAFRAMECOMPOSER_H
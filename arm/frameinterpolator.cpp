@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "frameinterpolator.hpp"
+#include <algorithm>
+
+namespace epilepsia {
+
+constexpr frame_interpolator::clock::duration frame_interpolator::max_interval;
+
+frame_interpolator::frame_interpolator(int frame_size)
+    : from_(frame_size, 0)
+    , to_(frame_size, 0)
+    , frame_(frame_size, 0)
+{
+}
+
+void frame_interpolator::push(const uint8_t* data, int len, clock::time_point arrival)
+{
+    len = std::min<int>(len, to_.size());
+
+    // Start from what is on display, so that the LEDs never jump when a
+    // frame arrives before the previous one has been reached
+    std::copy(frame_.begin(), frame_.end(), from_.begin());
+    std::copy_n(data, len, to_.begin());
+    std::fill(to_.begin() + len, to_.end(), 0);
+
+    interval_ = arrival - arrival_;
+    if (interval_ > max_interval) {
+        interval_ = clock::duration::zero();
+    }
+    arrival_ = arrival;
+    pending_ = true;
+}
+
+const uint8_t* frame_interpolator::next(clock::time_point now)
+{
+    // Weight of the new frame in 1/256
+    int alpha = 256;
+    if (interval_ > clock::duration::zero()) {
+        alpha = std::min<int64_t>(256, (now - arrival_) * 256 / interval_);
+    }
+
+    if (alpha >= 256) {
+        std::copy(to_.begin(), to_.end(), frame_.begin());
+        pending_ = false;
+    } else {
+        // 16 bits intermediates, left for the compiler to vectorize
+        const uint8_t* __restrict from = from_.data();
+        const uint8_t* __restrict to = to_.data();
+        uint8_t* __restrict frame = frame_.data();
+        const int len = frame_.size();
+        for (int i = 0; i < len; i++) {
+            frame[i] = from[i] + (((to[i] - from[i]) * alpha) >> 8);
+        }
+    }
+
+    return frame_.data();
+}
+
+} // namespace epilepsia
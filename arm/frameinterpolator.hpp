@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIAFRAMEINTERPOLATOR_H
+#define EPILEPSIAFRAMEINTERPOLATOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace epilepsia {
+
+/**
+ * Blends linearly from what is on display to the last frame received, over
+ * the time elapsed between the last two frames received. Frames arriving at
+ * 30 fps can then be shown at the rate of the PRUs, one interval late.
+ */
+class frame_interpolator {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit frame_interpolator(int frame_size);
+
+    frame_interpolator(frame_interpolator const&) = delete;
+    frame_interpolator& operator=(frame_interpolator const&) = delete;
+
+    // A new frame to reach, missing bytes are black
+    void push(const uint8_t* data, int len, clock::time_point arrival);
+
+    // Something else has been shown, the next frame pushed is shown right away
+    void cut() { arrival_ = clock::time_point{}; }
+
+    // Frame to show at time now, pending() is false once it is the last frame pushed
+    const uint8_t* next(clock::time_point now);
+
+    bool pending() const { return pending_; }
+    int size() const { return frame_.size(); }
+
+private:
+    // Above that, the stream is considered to have stopped and restarted
+    static constexpr clock::duration max_interval = std::chrono::milliseconds(250);
+
+    std::vector<uint8_t> from_;
+    std::vector<uint8_t> to_;
+    std::vector<uint8_t> frame_;
+    clock::time_point arrival_{};
+    clock::duration interval_{ 0 };
+    bool pending_{ false };
+};
+
+} // namespace epilepsia
+
+#endif // EPILEPSIAFRAMEINTERPOLATOR_H
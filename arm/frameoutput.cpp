@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "frameoutput.hpp"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+
+namespace epilepsia {
+
+frame_queue::frame_queue(const frame_output_settings& settings, int frame_size)
+    : policy_(settings.policy)
+    , frame_size_(frame_size)
+{
+    int count = policy_ == frame_policy::latest ? 3 : std::max(settings.queue_depth, 1);
+    slots_.resize(count);
+    for (auto& s : slots_) {
+        // Room for a frame with 16 bits per channel
+        s.data.resize(frame_size * 2);
+    }
+    sem_init(&available_, 0, 0);
+}
+
+frame_queue::~frame_queue()
+{
+    sem_destroy(&available_);
+}
+
+void frame_queue::push(const uint8_t* data, int len, pixel_format format)
+{
+    len = std::min(len, format == pixel_format::rgb16 ? frame_size_ * 2 : frame_size_);
+    std::lock_guard<std::mutex> lock(push_mutex_);
+
+    if (policy_ == frame_policy::latest) {
+        auto& s = slots_[back_];
+        std::copy_n(data, len, s.data.begin());
+        s.length = len;
+        s.format = format;
+        s.arrival = std::chrono::steady_clock::now();
+
+        // Publish the back buffer, get the previous middle buffer back
+        uint8_t prev = middle_.exchange(back_ | dirty, std::memory_order_acq_rel);
+        back_ = prev & ~dirty;
+
+        if (prev & dirty) {
+            // The consumer never saw the previous frame
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            sem_post(&available_);
+        }
+    } else {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+            // Queue full
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto& s = slots_[head % slots_.size()];
+        std::copy_n(data, len, s.data.begin());
+        s.length = len;
+        s.format = format;
+        s.arrival = std::chrono::steady_clock::now();
+
+        head_.store(head + 1, std::memory_order_release);
+        sem_post(&available_);
+    }
+}
+
+bool frame_queue::wait(frame& f)
+{
+    while (sem_wait(&available_) != 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    if (interrupted_) {
+        return false;
+    }
+
+    take(f);
+    return true;
+}
+
+bool frame_queue::try_wait(frame& f)
+{
+    if (sem_trywait(&available_) != 0 || interrupted_) {
+        return false;
+    }
+
+    take(f);
+    return true;
+}
+
+void frame_queue::take(frame& f)
+{
+    slot* s;
+    if (policy_ == frame_policy::latest) {
+        // Swap the front buffer with the freshly published middle buffer
+        front_ = middle_.exchange(front_, std::memory_order_acq_rel) & ~dirty;
+        s = &slots_[front_];
+    } else {
+        s = &slots_[tail_.load(std::memory_order_relaxed) % slots_.size()];
+    }
+
+    f = { s->data.data(), s->length, s->format, s->arrival };
+}
+
+void frame_queue::release()
+{
+    if (policy_ == frame_policy::queue) {
+        tail_.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void frame_queue::interrupt()
+{
+    interrupted_ = true;
+    sem_post(&available_);
+}
+
+frame_output::frame_output(led_driver& driver, const frame_output_settings& settings, int frame_size)
+    : driver_(driver)
+    , queue_(settings, frame_size)
+{
+    if (settings.interpolation) {
+        interpolator_.reset(new frame_interpolator(frame_size));
+    }
+}
+
+void frame_output::start()
+{
+    if (!running_) {
+        running_ = true;
+        thread_ = std::thread(&frame_output::run, this);
+    }
+}
+
+void frame_output::stop()
+{
+    if (running_) {
+        running_ = false;
+        queue_.interrupt();
+        thread_.join();
+    }
+}
+
+void frame_output::run()
+{
+    frame_queue::frame frame;
+    bool received = false;
+
+    while (running_) {
+        // While blending, the queue is only polled between two frames
+        const bool blending = interpolator_ && interpolator_->pending();
+
+        if (blending ? queue_.try_wait(frame) : queue_.wait(frame)) {
+            if (interpolator_ && frame.format == pixel_format::rgb8) {
+                interpolator_->push(frame.data, frame.length, frame.arrival);
+                received = true;
+            } else {
+                // 16 bit frames are not interpolated
+                if (interpolator_) {
+                    interpolator_->cut();
+                }
+                present(frame.data, frame.length, frame.format, true);
+            }
+            queue_.release();
+        } else if (!blending) {
+            break;
+        }
+
+        if (interpolator_ && interpolator_->pending()) {
+            const uint8_t* blended = interpolator_->next(std::chrono::steady_clock::now());
+            present(blended, interpolator_->size(), pixel_format::rgb8, received);
+            received = false;
+        }
+    }
+}
+
+void frame_output::commit(const uint8_t* data, int len, pixel_format format)
+{
+    if (interpolator_) {
+        queue_.push(data, len, format);
+    } else {
+        present(data, len, format, true);
+    }
+}
+
+void frame_output::present(const uint8_t* data, int len, pixel_format format, bool received)
+{
+    std::lock_guard<std::mutex> lock(driver_mutex_);
+    driver_.commit_frame_buffer(data, len, format);
+    estimate_frame_rate();
+
+    if (!received) {
+        interpolated_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // A frame received counts as presented once it starts being blended in
+    uint32_t presented = presented_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (handler_) {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        handler_(presented, std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    }
+}
+
+void frame_output::write_metrics(std::string& out) const
+{
+    write_metric(out, "epilepsia_frames_presented_total", "Frames rendered and handed to the PRUs", "counter", presented_frames());
+    write_metric(out, "epilepsia_frames_dropped_total", "Frames dropped by the output queue", "counter", dropped_frames());
+    write_metric(out, "epilepsia_frames_interpolated_total", "Frames blended between two frames received", "counter", interpolated_frames());
+    driver_.write_metrics(out);
+}
+
+void frame_output::estimate_frame_rate()
+{
+    static auto start = std::chrono::steady_clock::now();
+    static uint32_t counter{ 0 };
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    if (std::chrono::duration<double, std::milli>(elapsed).count() > 1000) {
+        spdlog::debug("Frame rate: {}, dropped frames: {}", counter, dropped_frames());
+        start = std::chrono::steady_clock::now();
+        counter = 0;
+    }
+    counter++;
+}
+
+} // namespace epilepsia
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIAFRAMEOUTPUT_H
+#define EPILEPSIAFRAMEOUTPUT_H
+
+#include "frameinterpolator.hpp"
+#include "leddriver.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <semaphore.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace epilepsia {
+
+enum class frame_policy {
+    latest, // Drop stale frames, lowest latency
+    queue   // Play every frame as long as the queue does not overflow
+};
+
+struct frame_output_settings {
+    frame_policy policy{ frame_policy::latest };
+    int queue_depth{ 8 };
+    // Blend between the last two frames received at the rate of the PRUs.
+    // Frames from the shared memory ring are then copied into the queue.
+    bool interpolation{ false };
+};
+
+/**
+ * Frame queue with a single consumer. Producers may call push() from several
+ * threads (OPC server, DMX receiver...), they are serialized by a mutex while
+ * the consumer side stays lock free.
+ * With frame_policy::latest it is a triple buffer: the producer never waits
+ * and the consumer always gets the most recent frame. With frame_policy::queue
+ * it is a ring buffer of queue_depth frames. In both cases the producer never
+ * blocks and frames that can't be stored are counted as dropped.
+ */
+class frame_queue {
+public:
+    frame_queue(frame_queue const&) = delete;
+    frame_queue& operator=(frame_queue const&) = delete;
+
+    struct frame {
+        const uint8_t* data;
+        int length;
+        pixel_format format;
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+    frame_queue(const frame_output_settings& settings, int frame_size);
+    ~frame_queue();
+
+    // Producer side, from any thread
+    void push(const uint8_t* data, int len, pixel_format format);
+
+    // Consumer side. Returns false if interrupted, or if no frame is
+    // available for try_wait(). The frame is valid until release().
+    bool wait(frame& f);
+    bool try_wait(frame& f);
+    void release();
+    void interrupt();
+
+    uint32_t dropped_frames() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct slot {
+        std::vector<uint8_t> data;
+        int length{ 0 };
+        pixel_format format{ pixel_format::rgb8 };
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+    static constexpr uint8_t dirty = 0x04;
+
+    void take(frame& f);
+
+    const frame_policy policy_;
+    const int frame_size_;
+    std::vector<slot> slots_;
+    sem_t available_;
+    std::atomic<bool> interrupted_{ false };
+    std::atomic<uint32_t> dropped_{ 0 };
+    // Held by push(), back_ and head_ are only written under it
+    std::mutex push_mutex_;
+
+    // Triple buffer: index of the slot shared between producer and consumer
+    std::atomic<uint8_t> middle_{ 1 };
+    uint8_t back_{ 0 };
+    uint8_t front_{ 2 };
+
+    // Ring buffer
+    std::atomic<uint32_t> head_{ 0 };
+    std::atomic<uint32_t> tail_{ 0 };
+};
+
+/**
+ * Feed the led_driver from a dedicated thread so that the network thread
+ * never blocks while the PRUs are busy shifting out a frame.
+ */
+class frame_output {
+public:
+    // Called from the output thread once a frame has been handed to the PRUs,
+    // with the number of frames presented so far and a timestamp in microseconds
+    // of the monotonic clock.
+    using Handler = std::function<void(uint32_t, uint64_t)>;
+
+    frame_output(frame_output const&) = delete;
+    frame_output& operator=(frame_output const&) = delete;
+
+    frame_output(led_driver& driver, const frame_output_settings& settings, int frame_size);
+
+    void start();
+    void stop();
+
+    void push(const uint8_t* data, int len, pixel_format format = pixel_format::rgb8) { queue_.push(data, len, format); }
+
+    /**
+     * Render a frame owned by the caller without going through the queue.
+     * Blocks until the frame has been handed to the PRUs, the frame is left
+     * untouched. With interpolation the frame is copied into the queue like
+     * pushed ones instead, and the call returns at once.
+     */
+    void commit(const uint8_t* data, int len, pixel_format format = pixel_format::rgb8);
+    uint32_t dropped_frames() const { return queue_.dropped_frames(); }
+    uint32_t presented_frames() const { return presented_.load(std::memory_order_relaxed); }
+    uint32_t interpolated_frames() const { return interpolated_.load(std::memory_order_relaxed); }
+
+    // Append output and driver metrics in Prometheus text format
+    void write_metrics(std::string& out) const;
+
+    // Must be set before start()
+    template <typename T>
+    void set_handler(T&& handler) noexcept
+    {
+        handler_ = handler;
+    }
+
+private:
+    void run();
+    // received is false for the frames blended by the interpolator
+    void present(const uint8_t* data, int len, pixel_format format, bool received);
+    void estimate_frame_rate();
+
+    led_driver& driver_;
+    frame_queue queue_;
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+    Handler handler_;
+    // Serializes the output thread and commit()
+    std::mutex driver_mutex_;
+    std::atomic<uint32_t> presented_{ 0 };
+    std::atomic<uint32_t> interpolated_{ 0 };
+    // Only used by the output thread, null without interpolation
+    std::unique_ptr<frame_interpolator> interpolator_;
+};
+
+} // namespace epilepsia
+
+#endif // EPILEPSIAFRAMEOUTPUT_H
@@ -0,0 +1,489 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "framerenderer.hpp"
+#include "bittranspose.hpp"
+#include "dithering.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <type_traits>
+
+namespace epilepsia {
+
+namespace {
+
+    // 16 bit value to the 8 bits shifted out to the LEDs
+    template <bool dithering>
+    inline uint8_t quantize(int d, int16_t& residual)
+    {
+        return dithering ? dither(d, residual) : d >> 8;
+    }
+
+} // namespace
+
+frame_renderer::frame_renderer(led_driver_settings& settings)
+    : strip_length_(settings.strip_length)
+    , strip_count_(settings.strip_count)
+    , bytes_per_strip_(settings.strip_length * 3)
+    , frame_buffer_size_(bytes_per_strip_ * settings.strip_count)
+    , columns_(bytes_per_strip_ / 4)
+    , block_columns_(columns_per_block(strip_count_, columns_))
+    , settings_(settings)
+    , residual_(frame_buffer_size_)
+    , block_(block_columns_ * strip_count_)
+    , previous_(frame_buffer_size_ / 4)
+    , output_(frame_buffer_size_ / 4)
+    , shown_(frame_buffer_size_ / 4)
+    , levels_((columns_ + block_columns_ - 1) / block_columns_ * strip_count_ * 3)
+{
+    update_lut();
+    update_pipeline();
+}
+
+template <int strips, int length>
+frame_renderer::pipelines frame_renderer::make_pipelines()
+{
+    return { strips, length, { { { &render_frame<strips, length, false, false, false>, &render_frame<strips, length, false, false, true> },
+                                   { &render_frame<strips, length, false, true, false>, &render_frame<strips, length, false, true, true> } },
+                                 { { &render_frame<strips, length, true, false, false>, &render_frame<strips, length, true, false, true> },
+                                   { &render_frame<strips, length, true, true, false>, &render_frame<strips, length, true, true, true> } } } };
+}
+
+void frame_renderer::update_pipeline()
+{
+    // Common geometries first, then a generic pipeline for every number of strips
+    static const pipelines table[] = {
+        make_pipelines<32, 64>(),
+        make_pipelines<16, 120>(),
+        make_pipelines<8, 0>(),
+        make_pipelines<16, 0>(),
+        make_pipelines<32, 0>(),
+    };
+
+    for (const auto& p : table) {
+        if (p.strip_count == strip_count_ && (p.strip_length == strip_length_ || p.strip_length == 0)) {
+            // The levels are only needed to estimate the current
+            const bool metering = settings_.estimate_current || settings_.max_current > 0;
+            pipeline_.store(p.render[settings_.zigzag][settings_.dithering][metering], std::memory_order_release);
+            return;
+        }
+    }
+}
+
+const uint32_t* frame_renderer::render(const uint8_t* buffer, int len, pixel_format format)
+{
+    render(buffer, len, output_.data(), format);
+    return output_.data();
+}
+
+void frame_renderer::render(const uint8_t* buffer, int len, uint32_t* out, pixel_format format)
+{
+    if (out != out_) {
+        out_ = out;
+        invalidate();
+    }
+
+    pipeline_.load(std::memory_order_acquire)(*this, buffer, len, format);
+}
+
+template <int strips, int length, bool zigzag, bool dithering, bool metering>
+void frame_renderer::render_frame(frame_renderer& r, const uint8_t* buffer, int len, pixel_format format)
+{
+    const int columns = length ? length * 3 / 4 : r.columns_;
+    const int block_columns = length ? columns_per_block(strips, columns) : r.block_columns_;
+
+    if (format == pixel_format::rgb16) {
+        for (auto begin = 0; begin < columns; begin += block_columns) {
+            const int end = std::min(begin + block_columns, columns);
+            std::fill_n(r.block_levels(begin), strips * 3, 0);
+            r.load_wide_block<strips, length, zigzag, dithering>(buffer, len, begin, end);
+            r.remap_columns<strips>(begin, 0, end - begin);
+        }
+
+        // The previous frame is not kept, the next 8 bit frame is rendered in full
+        r.invalidate();
+        return;
+    }
+
+    // A refresh asked for while rendering is not lost, it applies to the next frame
+    const uint32_t generation = r.generation_.load(std::memory_order_acquire);
+    const bool refresh = generation != r.rendered_generation_ || r.dithered_;
+
+    for (auto begin = 0; begin < columns; begin += block_columns) {
+        const int end = std::min(begin + block_columns, columns);
+        r.load_block<strips, length, zigzag>(buffer, len, begin, end);
+
+        if (dithering) {
+            // Temporal dithering changes the output of every LED at every frame
+            std::fill_n(r.block_levels(begin), strips * 3, 0);
+            r.update_block<strips, length, true, metering>(begin, end);
+            r.remap_columns<strips>(begin, 0, end - begin);
+        } else if (refresh) {
+            for (auto k = 0; k < strips; k++) {
+                std::copy_n(r.block_.data() + k * block_columns, end - begin, r.previous_.data() + k * columns + begin);
+            }
+            r.render_block<strips, length, metering>(begin, end);
+        } else {
+            r.render_changes<strips, length, metering>(begin, end);
+        }
+    }
+
+    if (!dithering) {
+        r.rendered_generation_ = generation;
+    }
+    r.dithered_ = dithering;
+}
+
+template <int strips, int length, bool zigzag>
+void frame_renderer::load_block(const uint8_t* buffer, int len, int begin, int end)
+{
+    const int strip_length = length ? length : strip_length_;
+    const int bytes_per_strip = strip_length * 3;
+    const int block_columns = length ? columns_per_block(strips, strip_length * 3 / 4) : block_columns_;
+
+    // Blocks start and end on LED boundaries, 3 columns hold 4 LEDs
+    const int first = begin / 3 * 4;
+    const int last = end / 3 * 4;
+
+    // Every two lines of the display is wired upside-down: the LEDs of the
+    // second half of the strips are read backwards
+    const int half = strip_length / 2;
+    const int split = zigzag ? std::max(first, std::min(last, half)) : last;
+    auto source = [&](int led) {
+        return led < split ? led : 3 * half - 1 - led;
+    };
+
+    for (auto k = 0; k < strips; k++) {
+        const int strip = k * bytes_per_strip;
+        const uint8_t* in = buffer + strip;
+        uint8_t* out = reinterpret_cast<uint8_t*>(block_.data() + k * block_columns);
+
+        if (strip + bytes_per_strip <= len) {
+            // RGB to GRB
+            std::copy(in + first * 3, in + split * 3, out);
+            for (auto i = first; i < split; i++, out += 3) {
+                std::swap(out[0], out[1]);
+            }
+            for (auto i = split; i < last; i++, out += 3) {
+                const uint8_t* p = in + source(i) * 3;
+                out[0] = p[1];
+                out[1] = p[0];
+                out[2] = p[2];
+            }
+        } else {
+            // Short frame, missing bytes are black
+            static const int channels[3] = { 1, 0, 2 };
+            for (auto i = first; i < last; i++, out += 3) {
+                for (auto c = 0; c < 3; c++) {
+                    int j = strip + source(i) * 3 + channels[c];
+                    out[c] = j < len ? buffer[j] : 0;
+                }
+            }
+        }
+    }
+}
+
+template <int strips, int length, bool zigzag, bool dithering>
+void frame_renderer::load_wide_block(const uint8_t* buffer, int len, int begin, int end)
+{
+    const int strip_length = length ? length : strip_length_;
+    const int bytes_per_strip = strip_length * 3;
+    const int block_columns = length ? columns_per_block(strips, strip_length * 3 / 4) : block_columns_;
+
+    const int first = begin / 3 * 4;
+    const int last = end / 3 * 4;
+
+    const int half = strip_length / 2;
+    auto source = [&](int led) {
+        return !zigzag || led < half ? led : 3 * half - 1 - led;
+    };
+
+    for (auto k = 0; k < strips; k++) {
+        const int strip = k * bytes_per_strip * 2;
+        uint8_t* out = reinterpret_cast<uint8_t*>(block_.data() + k * block_columns);
+        int16_t* residual = residual_.data() + k * bytes_per_strip + begin * 4;
+        int* level = block_levels(begin) + k * 3;
+
+        if (dithering && strip + bytes_per_strip * 2 <= len) {
+            // RGB to GRB, dithered 8 levels at a time
+            uint16_t levels[block_size / strips];
+            uint16_t* l = levels;
+            for (auto i = first; i < last; i++, l += 3) {
+                const uint8_t* p = buffer + strip + source(i) * 6;
+                l[0] = wide_lut(p[2], p[3]);
+                l[1] = wide_lut(p[0], p[1]);
+                l[2] = wide_lut(p[4], p[5]);
+            }
+            dither_levels(levels, out, residual, (last - first) * 3, level);
+        } else if (strip + bytes_per_strip * 2 <= len) {
+            // RGB to GRB
+            int g = 0, r = 0, b = 0;
+            for (auto i = first; i < last; i++, out += 3, residual += 3) {
+                const uint8_t* p = buffer + strip + source(i) * 6;
+                g += out[0] = quantize<dithering>(wide_lut(p[2], p[3]), residual[0]);
+                r += out[1] = quantize<dithering>(wide_lut(p[0], p[1]), residual[1]);
+                b += out[2] = quantize<dithering>(wide_lut(p[4], p[5]), residual[2]);
+            }
+            level[0] += g;
+            level[1] += r;
+            level[2] += b;
+        } else {
+            // Short frame, missing channels are black
+            static const int channels[3] = { 1, 0, 2 };
+            for (auto i = first; i < last; i++, out += 3, residual += 3) {
+                for (auto c = 0; c < 3; c++) {
+                    int j = strip + source(i) * 6 + channels[c] * 2;
+                    out[c] = quantize<dithering>(j + 1 < len ? wide_lut(buffer[j], buffer[j + 1]) : 0, residual[c]);
+                    level[c] += out[c];
+                }
+            }
+        }
+    }
+}
+
+template <int strips, int length, bool dithering, bool metering>
+void frame_renderer::update_block(int begin, int end)
+{
+    const int bytes_per_strip = length ? length * 3 : bytes_per_strip_;
+    const int block_columns = length ? columns_per_block(strips, length * 3 / 4) : block_columns_;
+    const int n = (end - begin) * 4;
+
+    for (auto k = 0; k < strips; k++) {
+        uint8_t* buffer = reinterpret_cast<uint8_t*>(block_.data() + k * block_columns);
+        int* level = block_levels(begin) + k * 3;
+
+        // Gamma correction and brightness adjustment, then temporal dithering
+        if (dithering) {
+            int16_t* residual = residual_.data() + k * bytes_per_strip + begin * 4;
+            dither_bytes(buffer, lut_, residual, n, level);
+        } else if (!metering) {
+            for (auto i = 0; i < n; i++) {
+                buffer[i] = lut_[buffer[i]] >> 8;
+            }
+        } else {
+            // Blocks start on LED boundaries, channels are G, R and B in turn
+            int g = 0, r = 0, b = 0;
+            for (auto i = 0; i < n; i += 3) {
+                g += buffer[i] = lut_[buffer[i]] >> 8;
+                r += buffer[i + 1] = lut_[buffer[i + 1]] >> 8;
+                b += buffer[i + 2] = lut_[buffer[i + 2]] >> 8;
+            }
+            level[0] += g;
+            level[1] += r;
+            level[2] += b;
+        }
+    }
+}
+
+template <int strips, int length, bool metering>
+void frame_renderer::render_block(int begin, int end)
+{
+    const int columns = length ? length * 3 / 4 : columns_;
+    const int block_columns = length ? columns_per_block(strips, columns) : block_columns_;
+
+    if (metering) {
+        std::fill_n(block_levels(begin), strips * 3, 0);
+    }
+    update_block<strips, length, false, metering>(begin, end);
+    if (metering) {
+        for (auto k = 0; k < strips; k++) {
+            std::copy_n(block_.data() + k * block_columns, end - begin, shown_.data() + k * columns + begin);
+        }
+    }
+    remap_columns<strips>(begin, 0, end - begin);
+}
+
+template <int strips, int length, bool metering>
+void frame_renderer::render_changes(int begin, int end)
+{
+    const int columns = length ? length * 3 / 4 : columns_;
+    const int block_columns = length ? columns_per_block(strips, columns) : block_columns_;
+    const int n = end - begin;
+    std::array<uint32_t, block_size / 32> changed{};
+
+    // A column is made of the same 4 bytes of every strip, the transposition
+    // of a column does not depend on the other ones
+    for (auto k = 0; k < strips; k++) {
+        const uint32_t* in = block_.data() + k * block_columns;
+        uint32_t* previous = previous_.data() + k * columns + begin;
+        for (auto i = 0; i < n; i++) {
+            changed[i] |= in[i] != previous[i];
+            previous[i] = in[i];
+        }
+    }
+
+    const int count = std::count(changed.begin(), changed.begin() + n, 1);
+    if (count == 0) {
+        return;
+    }
+
+    // With many changes the runs to transpose get short and numerous, and
+    // the whole block is cheaper to render
+    if (count * full_block_ratio > n) {
+        render_block<strips, length, metering>(begin, end);
+        return;
+    }
+
+    if (!metering) {
+        // Gamma correction and brightness adjustment of the columns that changed
+        for (auto k = 0; k < strips; k++) {
+            uint8_t* p = reinterpret_cast<uint8_t*>(block_.data() + k * block_columns);
+            for (auto i = 0; i < n; i++, p += 4) {
+                if (changed[i]) {
+                    p[0] = lut_[p[0]] >> 8;
+                    p[1] = lut_[p[1]] >> 8;
+                    p[2] = lut_[p[2]] >> 8;
+                    p[3] = lut_[p[3]] >> 8;
+                }
+            }
+        }
+    } else {
+        // Gamma correction and brightness adjustment of the columns that changed.
+        // The levels of the strip are updated with the difference to what was
+        // shown: c0 is the channel of bytes 0 and 3 of the column, c1 of byte 1
+        // and c2 of byte 2
+        auto update = [this](uint8_t* p, uint32_t& shown, int& c0, int& c1, int& c2) {
+            const int n0 = lut_[p[0]] >> 8;
+            const int n1 = lut_[p[1]] >> 8;
+            const int n2 = lut_[p[2]] >> 8;
+            const int n3 = lut_[p[3]] >> 8;
+            c0 += n0 + n3 - static_cast<int>((shown & 0xFF) + (shown >> 24));
+            c1 += n1 - static_cast<int>((shown >> 8) & 0xFF);
+            c2 += n2 - static_cast<int>((shown >> 16) & 0xFF);
+            p[0] = n0;
+            p[1] = n1;
+            p[2] = n2;
+            p[3] = n3;
+            shown = n0 | n1 << 8 | n2 << 16 | n3 << 24;
+        };
+
+        for (auto k = 0; k < strips; k++) {
+            uint8_t* p = reinterpret_cast<uint8_t*>(block_.data() + k * block_columns);
+            uint32_t* shown = shown_.data() + k * columns + begin;
+            int g = 0, r = 0, b = 0;
+
+            // Blocks start on LED boundaries, 3 columns hold 4 LEDs: GRBG RBGR BGRB
+            for (auto i = 0; i < n; i += 3, p += 12) {
+                if (changed[i]) {
+                    update(p, shown[i], g, r, b);
+                }
+                if (changed[i + 1]) {
+                    update(p + 4, shown[i + 1], r, b, g);
+                }
+                if (changed[i + 2]) {
+                    update(p + 8, shown[i + 2], b, g, r);
+                }
+            }
+
+            int* level = block_levels(begin) + k * 3;
+            level[0] += g;
+            level[1] += r;
+            level[2] += b;
+        }
+    }
+
+    for (auto i = 0, first = -1; i <= n; i++) {
+        if (i < n && changed[i]) {
+            if (first < 0) {
+                first = i;
+            }
+        } else if (first >= 0) {
+            remap_columns<strips>(begin, first, i);
+            first = -1;
+        }
+    }
+}
+
+template <int strips>
+void frame_renderer::remap_columns(int offset, int begin, int end)
+{
+    using word = typename std::conditional<strips == 8, uint8_t, typename std::conditional<strips == 16, uint16_t, uint32_t>::type>::type;
+
+    // Column i of the frame takes one word per strip of output. The stride
+    // stays a runtime value: a constant one makes the transposition slower
+    remap_bits<word>(block_.data(), out_ + offset * strips, block_columns_, begin, end);
+}
+
+void frame_renderer::update_lut()
+{
+    static const std::array<uint8_t, 256> gamma8{
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
+        2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5,
+        5, 6, 6, 6, 6, 7, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10,
+        10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 15, 15, 16, 16,
+        17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23, 24, 24, 25,
+        25, 26, 27, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 35, 35, 36,
+        37, 38, 39, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 50,
+        51, 52, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 66, 67, 68,
+        69, 70, 72, 73, 74, 75, 77, 78, 79, 81, 82, 83, 85, 86, 87, 89,
+        90, 92, 93, 95, 96, 98, 99, 101, 102, 104, 105, 107, 109, 110, 112, 114,
+        115, 117, 119, 120, 122, 124, 126, 127, 129, 131, 133, 135, 137, 138, 140, 142,
+        144, 146, 148, 150, 152, 154, 156, 158, 160, 162, 164, 167, 169, 171, 173, 175,
+        177, 180, 182, 184, 186, 189, 191, 193, 196, 198, 200, 203, 205, 208, 210, 213,
+        215, 218, 220, 223, 225, 228, 231, 233, 236, 239, 241, 244, 247, 249, 252, 255
+    };
+
+    // Same gamma of 2.8 as gamma8, sampled every 256 values of a 16 bit channel
+    static const std::array<float, 257> gamma16 = [] {
+        std::array<float, 257> g;
+        for (auto i = 0; i <= 256; i++) {
+            g[i] = std::pow(std::min(i * 256, 65535) / 65535.f, 2.8f);
+        }
+        return g;
+    }();
+
+    const float brightness = (settings_.brightness > 1.f ? 1.f : settings_.brightness) * gain_;
+
+    for (auto i = 0; i < 256; i++) {
+        // lut_[i] between 0 and 0xFFFF
+        lut_[i] = gamma8[i] * 257 * brightness;
+    }
+
+    for (auto i = 0; i < 256; i++) {
+        wide_lut_[i].base = gamma16[i] * 65535 * brightness + 0.5f;
+        wide_lut_[i].slope = static_cast<int>(gamma16[i + 1] * 65535 * brightness + 0.5f) - wide_lut_[i].base;
+    }
+
+    // Every LED has to be gamma corrected again
+    invalidate();
+}
+
+void frame_renderer::set_gain(float gain)
+{
+    // Every change of the LUT renders a frame in full, small steps are not worth it
+    if (gain != gain_ && (std::abs(gain - gain_) >= 1.f / 256 || gain == 1.f)) {
+        gain_ = gain;
+        update_lut();
+    }
+}
+
+int frame_renderer::current(int strip) const
+{
+    int level[3] = {};
+    for (auto begin = 0; begin < columns_; begin += block_columns_) {
+        const int* block = block_levels(begin) + strip * 3;
+        level[0] += block[0];
+        level[1] += block[1];
+        level[2] += block[2];
+    }
+    const float dynamic = level[0] * settings_.green_current + level[1] * settings_.red_current + level[2] * settings_.blue_current;
+    return dynamic / 255 + settings_.idle_current * strip_length_;
+}
+
+} // namespace epilepsia
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIAFRAMERENDERER_H
+#define EPILEPSIAFRAMERENDERER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+namespace epilepsia {
+
+struct led_driver_settings {
+    int strip_length{64};
+    int strip_count{32};
+    bool zigzag{ false };
+    bool dithering{ false };
+    float brightness{ 0.1f };
+    // Current drawn by a LED in mA, per channel at full level and when off
+    float red_current{ 20.f };
+    float green_current{ 20.f };
+    float blue_current{ 20.f };
+    float idle_current{ 1.f };
+    // Estimate the current drawn by every frame, always done with a limit
+    bool estimate_current{ true };
+    // Budget of the power supply in mA, frames are dimmed above it. 0 for no limit
+    float max_current{ 0.f };
+};
+
+// Layout of the frames handed to the renderer
+enum class pixel_format {
+    rgb8, // 3 bytes per LED
+    rgb16 // 6 bytes per LED, big endian like OPC command 2
+};
+
+/**
+ * Zero initialized scratch memory aligned on a cache line, allocated once.
+ */
+template <typename T>
+class aligned_buffer {
+public:
+    explicit aligned_buffer(size_t size)
+    {
+        void* p = nullptr;
+        if (posix_memalign(&p, 64, std::max<size_t>(size, 1) * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        data_.reset(static_cast<T*>(p));
+        std::fill_n(data_.get(), size, T{});
+    }
+
+    T* data() { return data_.get(); }
+    const T* data() const { return data_.get(); }
+
+private:
+    struct deleter {
+        void operator()(T* p) const { std::free(p); }
+    };
+    std::unique_ptr<T[], deleter> data_;
+};
+
+/**
+ * Turn RGB frames into what the PRUs expect: GRB, gamma corrected,
+ * dithered and with the bits of all strips interleaved.
+ * Does not touch the hardware, so that it can be benchmarked anywhere.
+ */
+class frame_renderer {
+public:
+    frame_renderer(frame_renderer const&) = delete;
+    frame_renderer& operator=(frame_renderer const&) = delete;
+
+    explicit frame_renderer(led_driver_settings& settings);
+
+    /**
+     * Render a frame, missing bytes are black. 16 bit frames are always
+     * rendered in full, through a gamma curve interpolated on 16 bits.
+     * Writes frame_buffer_size() / 4 words ready to be sent to the PRUs to
+     * out, in ascending order and never reading them back. Without
+     * dithering, only the columns of LEDs that changed since the previous
+     * frame are gamma corrected, transposed and written again: out must
+     * still hold the previous frame, unless it is a new destination or
+     * invalidate() has been called.
+     */
+    void render(const uint8_t* buffer, int len, uint32_t* out, pixel_format format = pixel_format::rgb8);
+
+    // Same as above, in a buffer owned by the renderer
+    const uint32_t* render(const uint8_t* buffer, int len, pixel_format format = pixel_format::rgb8);
+
+    // The destination has been overwritten, the next frame is rendered in full
+    void invalidate() { generation_.fetch_add(1, std::memory_order_release); }
+
+    void update_lut();
+
+    // Select the pipeline matching the settings, after zigzag or dithering changed
+    void update_pipeline();
+
+    // Scale the brightness, from 0 to 1, for current limiting
+    void set_gain(float gain);
+
+    // Current drawn by a strip for the last frame rendered, estimated from
+    // the levels sent to the LEDs, in mA. The levels of non-dithered 8 bit
+    // frames are only kept when the current is estimated
+    int current(int strip) const;
+
+    int frame_buffer_size() const { return frame_buffer_size_; }
+
+private:
+    // The frame is rendered one block of columns at a time, every stage of
+    // the pipeline runs on a block while it is still in the L1 cache.
+    // With the 16 bit residuals of dithering a block takes about 4 times its
+    // size in cache, which fits the 32 KiB L1 of the Cortex-A8.
+    static constexpr int block_size = 4096;
+
+    static constexpr int columns_per_block(int strip_count, int columns)
+    {
+        // Whole LEDs only, 3 columns hold 4 LEDs
+        return std::max(3, std::min(columns, block_size / (strip_count * 4)) / 3 * 3);
+    }
+
+    // The pipeline is specialized on the number of strips, their length
+    // (0 when only known at runtime), zigzag, dithering and on keeping the
+    // levels sent for current limiting, so that the compiler sees fixed loop
+    // bounds and no branch on the settings
+    using pipeline = void (*)(frame_renderer&, const uint8_t*, int, pixel_format);
+
+    struct pipelines {
+        int strip_count;
+        int strip_length;
+        pipeline render[2][2][2]; // [zigzag][dithering][metering]
+    };
+
+    template <int strips, int length>
+    static pipelines make_pipelines();
+
+    template <int strips, int length, bool zigzag, bool dithering, bool metering>
+    static void render_frame(frame_renderer& r, const uint8_t* buffer, int len, pixel_format format);
+
+    template <int strips, int length, bool zigzag>
+    void load_block(const uint8_t* buffer, int len, int begin, int end);
+
+    // Load, gamma correct and dither a block of a 16 bit frame in one pass
+    template <int strips, int length, bool zigzag, bool dithering>
+    void load_wide_block(const uint8_t* buffer, int len, int begin, int end);
+
+    // 16 bit gamma correction and brightness adjustment
+    int wide_lut(int high, int low) const
+    {
+        return wide_lut_[high].base + ((wide_lut_[high].slope * low) >> 8);
+    }
+
+    template <int strips, int length, bool dithering, bool metering>
+    void update_block(int begin, int end);
+
+    // Sums of the levels of the block starting at column begin, a block
+    // rendered in full overwrites them instead of updating the frame total
+    int* block_levels(int begin) { return levels_.data() + begin / block_columns_ * strip_count_ * 3; }
+    const int* block_levels(int begin) const { return levels_.data() + begin / block_columns_ * strip_count_ * 3; }
+
+    // Gamma correct and transpose a whole block of a non-dithered frame
+    template <int strips, int length, bool metering>
+    void render_block(int begin, int end);
+
+    // Same, only for the columns that changed since the previous frame
+    template <int strips, int length, bool metering>
+    void render_changes(int begin, int end);
+
+    // render_changes renders the whole block once more than 1 column in
+    // full_block_ratio changed, see bench/delta
+    static constexpr int full_block_ratio = 2;
+
+    template <int strips>
+    void remap_columns(int offset, int begin, int end);
+
+    const int strip_length_;
+    const int strip_count_;
+    const int bytes_per_strip_;
+    const int frame_buffer_size_;
+    const int columns_;
+    const int block_columns_;
+
+    uint16_t lut_[256];
+
+    // Gamma curve of 16 bit channels, linear between every 256 values
+    struct segment {
+        int base;
+        int slope;
+    };
+    segment wide_lut_[256];
+    led_driver_settings& settings_;
+    aligned_buffer<int16_t> residual_;
+
+    // Columns of the block being rendered, strip after strip
+    aligned_buffer<uint32_t> block_;
+
+    // Previous frame, before gamma correction, and where it was rendered
+    aligned_buffer<uint32_t> previous_;
+    uint32_t* out_{ nullptr };
+    aligned_buffer<uint32_t> output_;
+
+    // Previous frame as sent to the LEDs, and the sum of its levels for
+    // each block and strip, in GRB order
+    aligned_buffer<uint32_t> shown_;
+    aligned_buffer<int> levels_;
+    float gain_{ 1.f };
+    // Bumped by invalidate(), the next non-dithered frame is rendered in full
+    // unless it matches the generation of the last one
+    std::atomic<uint32_t> generation_{ 1 };
+    uint32_t rendered_generation_{ 0 };
+    bool dithered_{ false };
+
+    std::atomic<pipeline> pipeline_{ nullptr };
+};
+
+} // namespace epilepsia
+
+#endif // EPILEPSIAFRAMERENDERER_H
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "iouring.hpp"
+
+#ifdef EPILEPSIA_IO_URING
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+namespace epilepsia {
+
+namespace {
+
+    int io_uring_setup(unsigned entries, io_uring_params* params)
+    {
+        return syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+    {
+        return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+} // namespace
+
+io_uring_queue::~io_uring_queue()
+{
+    close();
+}
+
+bool io_uring_queue::supported()
+{
+    utsname name;
+    int major = 0, minor = 0;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2) {
+        return false;
+    }
+    return major > 6 || (major == 6 && minor >= 0);
+}
+
+bool io_uring_queue::init(unsigned entries)
+{
+    io_uring_params params{};
+    fd_ = io_uring_setup(entries, &params);
+    if (fd_ < 0) {
+        spdlog::warn("io_uring_setup failed: {}", strerror(errno));
+        return false;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        spdlog::warn("io_uring is too old");
+        close();
+        return false;
+    }
+
+    // Submission and completion rings share a single mapping
+    sq_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sq_ptr_ == MAP_FAILED || sqes == MAP_FAILED) {
+        spdlog::warn("Could not map io_uring: {}", strerror(errno));
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size_);
+        }
+        sq_ptr_ = nullptr;
+        close();
+        return false;
+    }
+
+    auto base = static_cast<uint8_t*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+    cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+    // Entries are always used in order, the indirection array is the identity
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array_[i] = i;
+    }
+
+    return true;
+}
+
+void io_uring_queue::cancel_all()
+{
+    constexpr uint64_t cancel_data = ~0ull;
+
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = cancel_data;
+
+    bool done = false;
+    while (!done) {
+        if (submit(1) < 0 && errno != EINTR) {
+            return;
+        }
+        for_each_cqe([&](const io_uring_cqe& cqe) {
+            done |= cqe.user_data == cancel_data;
+        });
+    }
+}
+
+void io_uring_queue::close()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    if (sqes_) {
+        munmap(sqes_, sqes_size_);
+        sqes_ = nullptr;
+    }
+    if (sq_ptr_) {
+        munmap(sq_ptr_, sq_size_);
+        sq_ptr_ = nullptr;
+    }
+    if (buffer_ring_) {
+        munmap(buffer_ring_, buffer_ring_size_);
+        buffer_ring_ = nullptr;
+    }
+    delete[] buffers_;
+    buffers_ = nullptr;
+}
+
+io_uring_sqe* io_uring_queue::get_sqe()
+{
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) > *sq_mask_) {
+        submit(0);
+    }
+
+    io_uring_sqe* sqe = &sqes_[tail & *sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    sq_pending_++;
+    return sqe;
+}
+
+int io_uring_queue::submit(unsigned wait_nr)
+{
+    int ret = io_uring_enter(fd_, sq_pending_, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0) {
+        sq_pending_ -= std::min<unsigned>(ret, sq_pending_);
+    }
+    return ret;
+}
+
+bool io_uring_queue::register_buffers(uint16_t group, unsigned count, size_t size)
+{
+    buffer_ring_size_ = count * sizeof(io_uring_buf);
+    buffer_ring_ = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buffer_ring_ == MAP_FAILED) {
+        buffer_ring_ = nullptr;
+        return false;
+    }
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uintptr_t>(buffer_ring_);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        spdlog::warn("Could not register io_uring buffers: {}", strerror(errno));
+        return false;
+    }
+
+    buffers_ = new uint8_t[count * size];
+    buffer_size_ = size;
+    buffer_count_ = count;
+    for (unsigned i = 0; i < count; i++) {
+        recycle_buffer(i);
+    }
+
+    return true;
+}
+
+void io_uring_queue::recycle_buffer(uint16_t id)
+{
+    // Not ring->bufs, __DECLARE_FLEX_ARRAY shifts it by 8 bytes in C++.
+    // The tail overlays the reserved field of the first entry.
+    auto ring = static_cast<io_uring_buf_ring*>(buffer_ring_);
+    io_uring_buf& buf = static_cast<io_uring_buf*>(buffer_ring_)[buffer_tail_ & (buffer_count_ - 1)];
+    buf.addr = reinterpret_cast<uintptr_t>(buffer(id));
+    buf.len = buffer_size_;
+    buf.bid = id;
+    __atomic_store_n(&ring->tail, ++buffer_tail_, __ATOMIC_RELEASE);
+}
+
+} // namespace epilepsia
+
+#endif // EPILEPSIA_IO_URING
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIAIOURING_H
+#define EPILEPSIAIOURING_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Multishot accept and receive with a ring of provided buffers need
+// linux 6.0, the kernel headers of older toolchains don't even know them.
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define EPILEPSIA_IO_URING 1
+#endif
+#endif
+#endif
+
+namespace epilepsia {
+
+#ifdef EPILEPSIA_IO_URING
+
+/**
+ * Minimal io_uring wrapper: submission and completion rings, plus one
+ * ring of provided receive buffers. Only used by the thread that owns it.
+ */
+class io_uring_queue {
+public:
+    io_uring_queue() = default;
+    ~io_uring_queue();
+
+    io_uring_queue(io_uring_queue const&) = delete;
+    io_uring_queue& operator=(io_uring_queue const&) = delete;
+
+    // Whether the running kernel supports what we need
+    static bool supported();
+
+    bool init(unsigned entries);
+
+    // Cancel all pending requests and wait for them, so that the files they
+    // reference are released before the ring is torn down
+    void cancel_all();
+    void close();
+
+    // Returns a zeroed submission entry, submitting pending ones if the ring is full
+    io_uring_sqe* get_sqe();
+
+    // Submit pending entries and wait for at least wait_nr completions
+    int submit(unsigned wait_nr);
+
+    // Call handler on each available completion, returns how many were handled
+    template <typename T>
+    unsigned for_each_cqe(T&& handler)
+    {
+        unsigned count = 0;
+        unsigned head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            handler(cqes_[head & *cq_mask_]);
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * Register count buffers of size bytes as buffer group group.
+     * count must be a power of two.
+     */
+    bool register_buffers(uint16_t group, unsigned count, size_t size);
+    uint8_t* buffer(uint16_t id) { return buffers_ + static_cast<size_t>(id) * buffer_size_; }
+
+    // Give a buffer back to the kernel once its content has been consumed
+    void recycle_buffer(uint16_t id);
+
+private:
+    int fd_{ -1 };
+
+    void* sq_ptr_{ nullptr };
+    size_t sq_size_{ 0 };
+    unsigned* sq_head_{ nullptr };
+    unsigned* sq_tail_{ nullptr };
+    unsigned* sq_mask_{ nullptr };
+    unsigned* sq_array_{ nullptr };
+    io_uring_sqe* sqes_{ nullptr };
+    size_t sqes_size_{ 0 };
+    unsigned sq_pending_{ 0 };
+
+    unsigned* cq_head_{ nullptr };
+    unsigned* cq_tail_{ nullptr };
+    unsigned* cq_mask_{ nullptr };
+    io_uring_cqe* cqes_{ nullptr };
+
+    void* buffer_ring_{ nullptr };
+    size_t buffer_ring_size_{ 0 };
+    uint8_t* buffers_{ nullptr };
+    size_t buffer_size_{ 0 };
+    unsigned buffer_count_{ 0 };
+    uint16_t buffer_tail_{ 0 };
+};
+
+#else
+
+class io_uring_queue {
+public:
+    static bool supported() { return false; }
+};
+
+#endif // EPILEPSIA_IO_URING
+
+} // namespace epilepsia
+
+#endif // EPILEPSIAIOURING_H
@@ -17,7 +17,7 @@
 #include "leddriver.hpp"
 #include <spdlog/spdlog.h>
 #include <algorithm>
-#include <array>
+#include <chrono>
 
 namespace epilepsia {
 
@@ -31,7 +31,12 @@ led_driver::led_driver(led_driver_settings& settings)
     , bytes_per_strip_(settings.strip_length * 3)
     , frame_buffer_size_(bytes_per_strip_ * settings.strip_count)
     , settings_(settings)
+    , render_settings_(settings)
+    , renderer_(render_settings_)
     , pru_driver_(strip_length_, strip_count_)
+    , brightness_(settings.brightness)
+    , dithering_(settings.dithering)
+    , strip_currents_(strip_count_)
 {
 
     // remap_bits needs strip_length > 4
@@ -52,12 +57,13 @@ led_driver::led_driver(led_driver_settings& settings)
         std::exit(EXIT_FAILURE);
     }
 
-    residual_.resize(frame_buffer_size_);
-    update_lut();
-
     spdlog::info("Strip count: {}", strip_count_);
     spdlog::info("Strip length: {}", strip_length_);
     spdlog::info("Frame buffer size: {}", frame_buffer_size_);
+
+    if (settings_.max_current > 0) {
+        spdlog::info("Current limit: {} mA", settings_.max_current);
+    }
 }
 
 led_driver::~led_driver()
@@ -66,143 +72,103 @@ led_driver::~led_driver()
 
 void led_driver::set_brightness(float brightness) {
     settings_.brightness = brightness;
-    update_lut();
+    brightness_.store(brightness, std::memory_order_relaxed);
 }
 
-void led_driver::clear()
-{
-    uint8_t buf[frame_buffer_size_];
-    std::fill(buf, buf + frame_buffer_size_, 0);
-    pru_driver_.write_frame(buf, frame_buffer_size_);
+void led_driver::set_dithering(bool dithering) {
+    settings_.dithering = dithering;
+    dithering_.store(dithering, std::memory_order_relaxed);
 }
 
-void led_driver::commit_frame_buffer(uint8_t* buffer, int len)
+void led_driver::apply_settings()
 {
-    uint8_t tmp[frame_buffer_size_];
-
-    if (len < frame_buffer_size_) {
-        std::copy_n(buffer, len, tmp);
-        buffer = tmp;
+    const float brightness = brightness_.load(std::memory_order_relaxed);
+    if (brightness != render_settings_.brightness) {
+        render_settings_.brightness = brightness;
+        renderer_.update_lut();
     }
 
-    // RGB to GRB
-    for (auto i = 0; i < frame_buffer_size_; i += 3) {
-        uint8_t p = buffer[i];
-        buffer[i] = buffer[i + 1];
-        buffer[i + 1] = p;
+    const bool dithering = dithering_.load(std::memory_order_relaxed);
+    if (dithering != render_settings_.dithering) {
+        render_settings_.dithering = dithering;
+        renderer_.update_pipeline();
     }
+}
 
-    if (settings_.zigzag) {
-        // Every two lines of the display is wired upside-down
-        for (auto i = bytes_per_strip_ / 2; i < frame_buffer_size_; i += bytes_per_strip_) {
-            for (auto j = 0; j < bytes_per_strip_ / 4; j += 3) {
-                uint8_t p = buffer[i + j];
-                buffer[i + j] = buffer[i + bytes_per_strip_ / 2 - 1 - j - 2];
-                buffer[i + bytes_per_strip_ / 2 - 1 - j - 2] = p;
-
-                p = buffer[i + j + 1];
-                buffer[i + j + 1] = buffer[i + bytes_per_strip_ / 2 - 1 - j - 1];
-                buffer[i + bytes_per_strip_ / 2 - 1 - j - 1] = p;
-
-                p = buffer[i + j + 2];
-                buffer[i + j + 2] = buffer[i + bytes_per_strip_ / 2 - 1 - j];
-                buffer[i + bytes_per_strip_ / 2 - 1 - j] = p;
-            }
-        }
-    }
+void led_driver::clear()
+{
+    uint32_t* frame = pru_driver_.acquire_frame();
+    std::fill_n(frame, frame_buffer_size_ / 4, 0);
+    pru_driver_.present_frame();
+    renderer_.invalidate();
+}
 
-    if (settings_.dithering) {
-        update_buffer<true>(buffer);
-    } else {
-        update_buffer<false>(buffer);
-    }
+void led_driver::commit_frame_buffer(const uint8_t* buffer, int len, pixel_format format)
+{
+    apply_settings();
 
-    uint32_t* in = reinterpret_cast<uint32_t*>(buffer);
-    uint32_t out[frame_buffer_size_ / 4];
+    // The frame is rendered straight into the shared memory of the PRUs
+    uint32_t* frame = pru_driver_.acquire_frame();
+    auto start = std::chrono::steady_clock::now();
+    renderer_.render(buffer, len, frame, format);
+    render_time_.observe(std::chrono::steady_clock::now() - start);
+    pru_driver_.present_frame();
 
-    if (strip_count_ == 8) {
-        remap_bits<uint8_t>(in, out, bytes_per_strip_ / 4);
-    } else if (strip_count_ == 16) {
-        remap_bits<uint16_t>(in, out, bytes_per_strip_ / 4);
-    } else {
-        remap_bits<uint32_t>(in, out, bytes_per_strip_ / 4);
+    if (gain_ < 1.f) {
+        limited_frames_.fetch_add(1, std::memory_order_relaxed);
     }
-
-    pru_driver_.write_frame(out, frame_buffer_size_ / 4);
+    limit_current();
 }
 
-template <bool dithering>
-void led_driver::update_buffer(uint8_t* buffer)
+void led_driver::limit_current()
 {
-    for (auto i = 0; i < frame_buffer_size_; i++) {
-
-        // Gamma correction and brightness adjustment
-        int d = lut_[buffer[i]];
-
-        // Temporal dithering
-        if (dithering) {
+    if (!settings_.estimate_current && settings_.max_current <= 0) {
+        return;
+    }
 
-            // Compiles to a single usat ARM instruction
-            auto usat = [](int a) {
-                return a > 65535 ? 65535 : a < 0 ? 0 : a;
-            };
+    int current = 0;
+    for (auto k = 0; k < strip_count_; k++) {
+        const int c = renderer_.current(k);
+        strip_currents_[k].store(c, std::memory_order_relaxed);
+        current += c;
+    }
+    current_.store(current, std::memory_order_relaxed);
 
-            d += residual_[i];
-            int e = usat(d + 0x80) >> 8;
-            residual_[i] = d - (e * 257);
-            buffer[i] = e;
+    if (settings_.max_current <= 0) {
+        return;
+    }
 
-        } else {
-            buffer[i] = d >> 8;
-        }
+    // Only the current of lit LEDs follows the brightness, about linearly
+    const float idle = settings_.idle_current * strip_length_ * strip_count_;
+    const float budget = settings_.max_current - idle;
+    const float lit = current - idle;
+    const float target = lit > 0 ? std::max(0.f, std::min(1.f, budget * gain_ / lit)) : 1.f;
+
+    if (target < gain_) {
+        // Over budget, the next frame is dimmed to fit in it
+        gain_ = target;
+    } else if (target == 1.f || target > gain_ * 1.05f) {
+        // Back up over a few dozen frames. The levels of the LEDs are
+        // integers, without a margin the gain would flip between two steps
+        gain_ = target - gain_ < 1.f / 256 ? target : gain_ + (target - gain_) / 16;
     }
+    renderer_.set_gain(gain_);
 }
 
-template <typename T>
-void led_driver::remap_bits(uint32_t* in, uint32_t* out, const int len)
+void led_driver::write_metrics(std::string& out) const
 {
-    constexpr const uint32_t mask = sizeof(T) == 4 ? 0x00000001 : sizeof(T) == 2 ? 0x00010001 : 0x01010101;
-
-    for (auto i = 0, ii = 0; i < len; i++, ii += 32) {
-        for (size_t l = 0; l < sizeof(T) * 8; l += 8) {
-            for (auto j = 0; j < 8; j++) {
-                uint32_t m = 0;
-                for (size_t k = 0, kk = 0; k < sizeof(T) * 8; k++, kk += len) {
-                    uint32_t n = in[i + kk];
-                    m |= (((n >> (7 + l - j)) & mask) << (sizeof(T) * 8 - 1 - k));
-                }
-                for (size_t k = 0; k < 32; k += sizeof(T) * 8) {
-                    reinterpret_cast<T*>(out)[ii + j + l + k] = (m >> k) & static_cast<T>(0xFFFFFFFF);
-                }
-            }
+    write_metric(out, "epilepsia_pru_frames_total", "Frames pushed to the PRUs", "counter", pru_driver_.frames());
+    render_time_.write(out, "epilepsia_render_seconds", "Time spent rendering a frame into the PRU shared memory");
+    pru_driver_.wait_time().write(out, "epilepsia_pru_wait_seconds", "Time blocked waiting for the PRUs to be ready");
+
+    if (settings_.estimate_current || settings_.max_current > 0) {
+        write_metric(out, "epilepsia_estimated_current", "Current drawn by the LEDs for the last frame in mA, estimated", "gauge", current_.load(std::memory_order_relaxed));
+        out += "# HELP epilepsia_strip_estimated_current Current drawn by each strip for the last frame in mA, estimated\n"
+               "# TYPE epilepsia_strip_estimated_current gauge\n";
+        for (auto k = 0; k < strip_count_; k++) {
+            out += fmt::format("epilepsia_strip_estimated_current{{strip=\"{}\"}} {}\n", k, strip_currents_[k].load(std::memory_order_relaxed));
         }
     }
+    write_metric(out, "epilepsia_current_limited_frames_total", "Frames dimmed by the current limiter", "counter", limited_frames_.load(std::memory_order_relaxed));
 }
-
-void led_driver::update_lut()
-{
-    static const std::array<uint8_t, 256> gamma8{
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
-        1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
-        2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5,
-        5, 6, 6, 6, 6, 7, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10,
-        10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 15, 15, 16, 16,
-        17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23, 24, 24, 25,
-        25, 26, 27, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 35, 35, 36,
-        37, 38, 39, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 50,
-        51, 52, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 66, 67, 68,
-        69, 70, 72, 73, 74, 75, 77, 78, 79, 81, 82, 83, 85, 86, 87, 89,
-        90, 92, 93, 95, 96, 98, 99, 101, 102, 104, 105, 107, 109, 110, 112, 114,
-        115, 117, 119, 120, 122, 124, 126, 127, 129, 131, 133, 135, 137, 138, 140, 142,
-        144, 146, 148, 150, 152, 154, 156, 158, 160, 162, 164, 167, 169, 171, 173, 175,
-        177, 180, 182, 184, 186, 189, 191, 193, 196, 198, 200, 203, 205, 208, 210, 213,
-        215, 218, 220, 223, 225, 228, 231, 233, 236, 239, 241, 244, 247, 249, 252, 255
-    };
-
-    for (auto i = 0; i < 256; i++) {
-        // lut_[i] between 0 and 0xFFFF
-        lut_[i] = gamma8[i] * 257 * (settings_.brightness > 1.f ? 1.f : settings_.brightness);
-    }
 }
-}
\ No newline at end of file
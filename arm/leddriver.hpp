@@ -17,21 +17,16 @@
 #ifndef EPILEPSIADRIVER_H
 #define EPILEPSIADRIVER_H
 
+#include "framerenderer.hpp"
 #include "prudriver.hpp"
+#include "metrics.hpp"
+#include <atomic>
 #include <cstdint>
+#include <string>
 #include <vector>
 
 namespace epilepsia {
 
-
-struct led_driver_settings {
-    int strip_length{64};
-    int strip_count{32};
-    bool zigzag{ false };
-    bool dithering{ false };
-    float brightness{ 0.1f };
-};
-
 class led_driver {
 public:
     led_driver(led_driver const&) = delete;
@@ -42,28 +37,45 @@ public:
     explicit led_driver(led_driver_settings& settings);
     ~led_driver();
 
-    void commit_frame_buffer(uint8_t* buffer, int len);
+    void commit_frame_buffer(const uint8_t* buffer, int len, pixel_format format = pixel_format::rgb8);
+    // Can be called from any thread, applied to the next frame rendered
     void set_brightness(float brightness);
+    void set_dithering(bool dithering);
     void clear();
 
-private:
-    void update_lut();
+    int frame_buffer_size() const { return frame_buffer_size_; }
 
-    template <typename T>
-    static void remap_bits(uint32_t* in, uint32_t* out, int len);
+    // Append render and PRU metrics in Prometheus text format
+    void write_metrics(std::string& out) const;
 
-    template <bool dithering>
-    void update_buffer(uint8_t* buffer);
+private:
+    // Brightness and dithering set by other threads take effect here, before
+    // a frame is rendered: only the rendering thread touches the renderer
+    void apply_settings();
+
+    // Estimate the current of the frame just rendered and scale the next one to the budget
+    void limit_current();
 
     const int strip_length_;
     const int strip_count_;
     const int bytes_per_strip_;
     const int frame_buffer_size_;
 
-    int lut_[256];
     led_driver_settings& settings_;
-    std::vector<int> residual_;
+    // Copy of the settings read by the renderer, owned by the rendering thread
+    led_driver_settings render_settings_;
+    frame_renderer renderer_;
     pru_driver pru_driver_;
+    histogram render_time_;
+
+    std::atomic<float> brightness_;
+    std::atomic<bool> dithering_;
+
+    // Brightness scale of the current limiter, only used by the rendering thread
+    float gain_{ 1.f };
+    std::atomic<int> current_{ 0 };
+    std::vector<std::atomic<int>> strip_currents_;
+    std::atomic<uint64_t> limited_frames_{ 0 };
 };
 }
 
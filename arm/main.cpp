@@ -15,9 +15,14 @@
  */
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
+#include "dmxreceiver.hpp"
+#include "framecomposer.hpp"
+#include "frameoutput.hpp"
 #include "leddriver.hpp"
+#include "metrics.hpp"
 #include "opcserver.hpp"
 #include "settings.hpp"
+#include "shmreceiver.hpp"
 #include <spdlog/spdlog.h>
 #include <chrono>
 #include <clara.hpp>
@@ -26,20 +31,6 @@
 
 volatile sig_atomic_t done = 0;
 
-void estimate_frame_rate()
-{
-    static auto start = std::chrono::steady_clock::now();
-    static uint32_t counter{ 0 };
-    auto elapsed = std::chrono::steady_clock::now() - start;
-
-    if (std::chrono::duration<double, std::milli>(elapsed).count() > 1000) {
-        spdlog::debug("Frame rate: {}", counter);
-        start = std::chrono::steady_clock::now();
-        counter = 0;
-    }
-    counter++;
-}
-
 int main(int argc, char* argv[])
 {
     bool help = false;
@@ -68,19 +59,42 @@ int main(int argc, char* argv[])
     }
 
     epilepsia::settings settings(file);
-    epilepsia::opc_server server(settings.server_ports);
+    epilepsia::opc_server server(settings.server);
     epilepsia::led_driver display(settings.driver);
+    epilepsia::frame_output output(display, settings.output, display.frame_buffer_size());
+    epilepsia::dmx_receiver dmx(settings.dmx, settings.driver);
+    epilepsia::frame_composer composer(settings.composer, settings.driver);
+    epilepsia::shm_receiver shm(settings.shm, settings.driver);
+
+    epilepsia::histogram compose_time;
+
+    // Blend the layers of the composer and queue the result. Layers that
+    // time out are hidden by composing again once they do, even if nothing
+    // else is written in the meantime.
+    auto push_composed = [&]() {
+        auto start = std::chrono::steady_clock::now();
+        auto frame = composer.compose();
+        compose_time.observe(std::chrono::steady_clock::now() - start);
+        output.push(frame, composer.size());
+        server.schedule(composer.next_timeout());
+    };
 
     signal(SIGINT, [](int signum) {
         done = 1;
     });
 
-    server.set_handler<epilepsia::opc_command::set_pixels>([&](uint8_t channel, uint16_t length, uint8_t* pixels) {
-        display.commit_frame_buffer(pixels, length);
-        estimate_frame_rate();
+    server.set_handler<epilepsia::opc_command::set_pixels>([&](uint8_t channel, uint16_t length, const uint8_t* pixels) {
+        if (composer.write(channel, pixels, length)) {
+            push_composed();
+        }
+    });
+
+    // 16 bit frames cover the whole display and bypass the composer, which blends 8 bit layers
+    server.set_handler<epilepsia::opc_command::set_pixels_16>([&](uint8_t channel, uint16_t length, const uint8_t* pixels) {
+        output.push(pixels, length, epilepsia::pixel_format::rgb16);
     });
 
-    server.set_handler<epilepsia::opc_command::system_exclusive>([&](uint8_t channel, uint16_t length, uint8_t* data) {
+    server.set_handler<epilepsia::opc_command::system_exclusive>([&](uint8_t channel, uint16_t length, const uint8_t* data) {
         if (length == 2) {
             switch (data[0]) {
 
@@ -91,7 +105,7 @@ int main(int argc, char* argv[])
 
             // Enable/disable dithering
             case 0x01:
-                settings.driver.dithering = data[1];
+                display.set_dithering(data[1]);
                 break;
             }
 
@@ -103,9 +117,55 @@ int main(int argc, char* argv[])
 	if (length == 1 && data[0] == 0x02) {
 	    done = 1;
 	}
+
+        // End of frame, commit the composed frame
+        if (length == 1 && data[0] == 0x03) {
+            push_composed();
+        }
+
+        // Delta frame, a list of ranges to update in the composed frame
+        if (length >= 1 && data[0] == 0x04) {
+            if (composer.write_ranges(channel, data + 1, length - 1)) {
+                push_composed();
+            }
+        }
+
+        // Compressed frame
+        if (length >= 2 && data[0] == 0x05) {
+            if (composer.write_compressed(channel, data + 1, length - 1)) {
+                push_composed();
+            }
+        }
+    });
+
+    dmx.set_handler([&](const uint8_t* pixels, int length) {
+        output.push(pixels, length);
+    });
+
+    // Frames from local producers are rendered straight from the ring, without
+    // copy, unless interpolation is on
+    shm.set_handler([&](const uint8_t* pixels, int length) {
+        output.commit(pixels, length);
     });
 
-    if (!server.start()) {
+    // Frame presented messages, for clients that opted in
+    output.set_handler([&](uint32_t frame, uint64_t timestamp) {
+        server.notify_presented(frame, timestamp);
+    });
+
+    server.set_timer_handler(push_composed);
+
+    server.set_metrics_handler([&](std::string& out) {
+        compose_time.write(out, "epilepsia_compose_seconds", "Time spent composing a frame");
+        output.write_metrics(out);
+    });
+
+    output.start();
+
+    if (!server.start() || !dmx.start() || !shm.start()) {
+        server.stop();
+        dmx.stop();
+        output.stop();
         std::exit(EXIT_FAILURE);
     }
 
@@ -113,7 +173,11 @@ int main(int argc, char* argv[])
         std::this_thread::sleep_for(std::chrono::seconds(1));
     }
 
+    // Local producers render through the output, which notifies the server
+    shm.stop();
+    output.stop();
     server.stop();
+    dmx.stop();
     display.clear();
 
     return 0;
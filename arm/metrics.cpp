@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "metrics.hpp"
+#include <spdlog/fmt/fmt.h>
+
+namespace epilepsia {
+
+constexpr std::array<uint32_t, 10> histogram::bounds;
+
+void histogram::write(std::string& out, const char* name, const char* help) const
+{
+    out += fmt::format("# HELP {} {}\n# TYPE {} histogram\n", name, help, name);
+
+    uint64_t count = 0;
+    for (size_t i = 0; i < bounds.size(); i++) {
+        count += buckets_[i].load(std::memory_order_relaxed);
+        out += fmt::format("{}_bucket{{le=\"{}\"}} {}\n", name, bounds[i] / 1e6, count);
+    }
+    count += buckets_[bounds.size()].load(std::memory_order_relaxed);
+    out += fmt::format("{}_bucket{{le=\"+Inf\"}} {}\n", name, count);
+    out += fmt::format("{}_sum {}\n{}_count {}\n", name, sum_us_.load(std::memory_order_relaxed) / 1e6, name, count);
+}
+
+void write_metric(std::string& out, const char* name, const char* help, const char* type, uint64_t value)
+{
+    out += fmt::format("# HELP {} {}\n# TYPE {} {}\n{} {}\n", name, help, name, type, name, value);
+}
+
+} // namespace epilepsia
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIAMETRICS_H
+#define EPILEPSIAMETRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace epilepsia {
+
+/**
+ * Latency histogram with fixed buckets, in microseconds.
+ * observe() is lock-free and may be called from any thread, a reader may
+ * see a sample in count but not yet in sum.
+ */
+class histogram {
+public:
+    static constexpr std::array<uint32_t, 10> bounds{ { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000 } };
+
+    void observe(std::chrono::steady_clock::duration d)
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        size_t i = 0;
+        while (i < bounds.size() && us > bounds[i]) {
+            i++;
+        }
+        buckets_[i].fetch_add(1, std::memory_order_relaxed);
+        sum_us_.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    // Append the histogram in Prometheus text format, in seconds
+    void write(std::string& out, const char* name, const char* help) const;
+
+private:
+    std::array<std::atomic<uint64_t>, bounds.size() + 1> buckets_{};
+    std::atomic<uint64_t> sum_us_{ 0 };
+};
+
+// Append a counter or a gauge in Prometheus text format
+void write_metric(std::string& out, const char* name, const char* help, const char* type, uint64_t value);
+
+} // namespace epilepsia
+
+#endif // EPILEPSIAMETRICS_H
@@ -15,31 +15,78 @@
  */
 
 #include "opcserver.hpp"
+#include "iouring.hpp"
+#include "metrics.hpp"
+#include "websocket.hpp"
 #include <spdlog/spdlog.h>
 #include <sha1.hpp>
 #include <algorithm>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <iostream>
+#include <map>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 namespace epilepsia {
 
+namespace {
+
+    // Sockets are non-blocking: recv() failing with EAGAIN just means that
+    // there is nothing more to read for now.
+    inline bool io_error(ssize_t len)
+    {
+        return len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+
+    // io_uring user data: what completed in the top byte, then a Client
+    // pointer or an index in listen_socks_ or udp_socks_
+    enum uring_tag : uint64_t {
+        tag_client = 0,
+        tag_wake,
+        tag_timer,
+        tag_accept,
+        tag_udp,
+        tag_output,
+        tag_cancel
+    };
+
+    constexpr int uring_tag_shift = 56;
+
+    inline uint64_t user_data(uring_tag tag, uint64_t value)
+    {
+        return (static_cast<uint64_t>(tag) << uring_tag_shift) | value;
+    }
+
+} // namespace
+
+constexpr std::chrono::seconds opc_server::udp_sender_timeout;
+
 opc_server::opc_server(std::initializer_list<uint16_t> ports)
-    : ports_(ports)
+    : settings_{ ports }
+{
+}
+
+opc_server::opc_server(const opc_server_settings& settings)
+    : settings_(settings)
 {
 }
 
-opc_server::opc_server(const std::vector<uint16_t>& ports)
-    : ports_(ports)
+opc_server::~opc_server()
 {
+    stop();
 }
 
 bool opc_server::start()
@@ -59,29 +106,35 @@ void opc_server::stop()
 {
     if (running_) {
         running_ = false;
+
+        // Wake up epoll_wait so that the loop notices it has to exit
+        uint64_t one = 1;
+        if (::write(wake_fd_, &one, sizeof(one)) < 0) {
+            spdlog::warn("Could not wake up the server thread: {}", strerror(errno));
+        }
         thread_.join();
+
+        for (auto client : clients_) {
+            if (client) {
+                ::close(client->get_fd());
+                release_client(client);
+            }
+        }
+        clients_.clear();
+        close_sockets();
     }
 }
 
 bool opc_server::listen()
 {
     // Create a server socket for each requested port.
-    for (auto& port : ports_) {
-        sockaddr_in address;
-        int one = 1;
-
-        int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-
-        address.sin_family = AF_INET;
-        address.sin_port = htons(port);
-        address.sin_addr.s_addr = htonl(INADDR_ANY);
-
-        if (bind(sock, (sockaddr*)&address, sizeof(address)) != 0) {
-            spdlog::error("Could not bind to port {}", port);
+    for (auto& port : settings_.ports) {
+        int sock = bind_socket(SOCK_STREAM, port);
+        if (sock < 0) {
             break;
-        } else if (::listen(sock, 0) != 0) {
+        } else if (::listen(sock, SOMAXCONN) != 0) {
             spdlog::error("Could not listen on port {}", port);
+            ::close(sock);
             break;
         } else {
             spdlog::info("Listening on port {}", port);
@@ -89,296 +142,1135 @@ bool opc_server::listen()
         }
     }
 
+    // And optionally a datagram socket on the same ports
+    if (settings_.udp && listen_socks_.size() == settings_.ports.size()) {
+        for (auto& port : settings_.ports) {
+            int sock = bind_socket(SOCK_DGRAM, port);
+            if (sock < 0) {
+                break;
+            }
+            // Room for a few full frames, in case we are a bit late
+            int size = 8 * udp_datagram_size;
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            spdlog::info("Listening on UDP port {}", port);
+            udp_socks_.push_back(sock);
+        }
+        udp_buffer_.resize(udp_batch_size * udp_datagram_size);
+    }
+
     // Could not listen on all provided ports, so we close all opened sockets
-    if (listen_socks_.size() != ports_.size()) {
-        for (auto& sock : listen_socks_) {
-            ::close(sock);
+    if (listen_socks_.size() != settings_.ports.size() || (settings_.udp && udp_socks_.size() != settings_.ports.size())) {
+        close_sockets();
+        return false;
+    }
+
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ < 0) {
+        spdlog::error("Could not create eventfd: {}", strerror(errno));
+        close_sockets();
+        return false;
+    }
+
+    // steady_clock is CLOCK_MONOTONIC
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ < 0) {
+        spdlog::error("Could not create timerfd: {}", strerror(errno));
+        close_sockets();
+        return false;
+    }
+
+    if (settings_.backend == io_backend::io_uring) {
+        if (setup_uring()) {
+            spdlog::info("Using io_uring");
+            return true;
         }
-        listen_socks_.resize(0);
+        spdlog::warn("io_uring not available, falling back to epoll");
+    }
+
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) {
+        spdlog::error("Could not create epoll instance: {}", strerror(errno));
+        close_sockets();
         return false;
     }
-    
+
+    // Server sockets and the wake up eventfd are identified by the address
+    // of their descriptor, clients by the address of their Client instance.
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+    ev.data.ptr = &timer_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev);
+    for (auto& sock : listen_socks_) {
+        ev.data.ptr = &sock;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, sock, &ev);
+    }
+    for (auto& sock : udp_socks_) {
+        ev.data.ptr = &sock;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, sock, &ev);
+    }
+
     return true;
 }
 
+int opc_server::bind_socket(int type, uint16_t port)
+{
+    sockaddr_in address;
+    int one = 1;
+
+    int sock = socket(PF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        spdlog::error("Could not create socket: {}", strerror(errno));
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(sock, (sockaddr*)&address, sizeof(address)) != 0) {
+        spdlog::error("Could not bind to port {}", port);
+        ::close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+void opc_server::close_sockets()
+{
+    if (uring_) {
+        uring_->cancel_all();
+        uring_.reset();
+    }
+
+    for (auto& sock : listen_socks_) {
+        ::close(sock);
+    }
+    for (auto& sock : udp_socks_) {
+        ::close(sock);
+    }
+    listen_socks_.resize(0);
+    udp_socks_.resize(0);
+    udp_senders_.clear();
+
+    if (epoll_fd_ >= 0) {
+        ::close(epoll_fd_);
+        epoll_fd_ = -1;
+    }
+    if (wake_fd_ >= 0) {
+        ::close(wake_fd_);
+        wake_fd_ = -1;
+    }
+    if (timer_fd_ >= 0) {
+        ::close(timer_fd_);
+        timer_fd_ = -1;
+    }
+    timer_ = std::chrono::steady_clock::time_point::max();
+}
+
 void opc_server::run()
 {
-    uint32_t timeout_ms = 2000;
-    fd_set active_fd_set, read_fd_set;
-    sockaddr_in clientname;
-    timeval timeout;
-    socklen_t address_len = sizeof(clientname);
-    char buffer[64];
+    if (uring_) {
+        run_uring();
+    } else {
+        run_epoll();
+    }
+}
 
-    // Initialize the set of active sockets.
-    FD_ZERO(&active_fd_set);
-    for (auto& sock : listen_socks_)
-        FD_SET(sock, &active_fd_set);
+void opc_server::run_epoll()
+{
+    constexpr int max_events = 16;
+    epoll_event events[max_events];
 
     while (running_) {
         // Block until input arrives on one or more active sockets.
-        read_fd_set = active_fd_set;
-        timeout.tv_sec = timeout_ms / 1000;
-        timeout.tv_usec = (timeout_ms % 1000) * 1000;
-        select(FD_SETSIZE, &read_fd_set, NULL, NULL, &timeout);
+        int n = epoll_wait(epoll_fd_, events, max_events, -1);
+        count_syscall();
+        if (n < 0) {
+            if (errno != EINTR) {
+                spdlog::error("epoll_wait failed: {}", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            void* ptr = events[i].data.ptr;
+
+            if (ptr == &wake_fd_) {
+                // stop() was called, or a frame has been presented
+                uint64_t count;
+                count_syscall();
+                if (::read(wake_fd_, &count, sizeof(count)) > 0 && running_) {
+                    send_presented();
+                }
+                continue;
+            }
+
+            if (ptr == &timer_fd_) {
+                handle_timer();
+                continue;
+            }
 
-        for (auto& i : listen_socks_) {
-            if (FD_ISSET(i, &read_fd_set)) {
+            auto is_sock = [ptr](const int& sock) { return &sock == ptr; };
+
+            auto listen_sock = std::find_if(listen_socks_.begin(), listen_socks_.end(), is_sock);
+            if (listen_sock != listen_socks_.end()) {
                 // Connection request on one of the server sockets.
-                int sock = accept(i, (struct sockaddr*)&clientname, &address_len);
-                if (sock >= 0) {
-                    inet_ntop(AF_INET, &(clientname.sin_addr), buffer, 64);
-                    spdlog::info("New connection from {}", buffer);
-                    FD_SET(sock, &active_fd_set);
-                    clients_.emplace(sock, Client(sock, *this));
+                accept_client(*listen_sock);
+                continue;
+            }
+
+            auto udp_sock = std::find_if(udp_socks_.begin(), udp_socks_.end(), is_sock);
+            if (udp_sock != udp_socks_.end()) {
+                // Datagrams arriving on one of the UDP sockets.
+                read_datagrams(*udp_sock);
+                continue;
+            }
+
+            // Data arriving on socket. The client may have been closed
+            // while handling a previous event of this batch.
+            auto client = static_cast<Client*>(ptr);
+            if (client->get_fd() < 0) {
+                continue;
+            }
+            if (client->replying()) {
+                // Only watched for writing, see watch_output()
+                if (!client->flush()) {
+                    close_client(client->get_fd());
                 }
-                FD_CLR(i, &read_fd_set);
+                continue;
+            }
+            if (!client->read()) {
+                close_client(client->get_fd());
             }
         }
+    }
+}
+
+void opc_server::accept_client(int listen_sock)
+{
+    sockaddr_in clientname;
+    socklen_t address_len = sizeof(clientname);
 
-        // Service all the clients with input pending.
-        for (int i = 0; i < FD_SETSIZE; ++i) {
-            if (FD_ISSET(i, &read_fd_set)) {
-                // Data arriving on socket.
-                if (!clients_.at(i).read()) {
-                    ::close(i);
-                    FD_CLR(i, &active_fd_set);
-                    spdlog::info("Client disconnected");
-                    clients_.erase(i);
+    // The listening socket is non-blocking, accept until the backlog is empty
+    while (true) {
+        int sock = accept4(listen_sock, (sockaddr*)&clientname, &address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        count_syscall();
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                spdlog::warn("accept failed: {}", strerror(errno));
+            }
+            return;
+        }
+
+        add_client(sock, clientname);
+    }
+}
+
+void opc_server::add_client(int sock, const sockaddr_in& address)
+{
+    char buffer[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &(address.sin_addr), buffer, sizeof(buffer));
+    auto name = fmt::format("{}:{}", buffer, ntohs(address.sin_port));
+    spdlog::info("New connection from {}", name);
+    stats_.connections.fetch_add(1, std::memory_order_relaxed);
+
+    Client* client = acquire_client(sock, std::move(name));
+    if (uring_) {
+        arm_recv(client);
+        return;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    count_syscall();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, sock, &ev) != 0) {
+        spdlog::warn("Could not watch client socket: {}", strerror(errno));
+        ::close(sock);
+        release_client(client);
+    }
+}
+
+void opc_server::close_client(int fd)
+{
+    Client* client = clients_[fd];
+
+    // Wait for the pending operations to be cancelled before recycling the client
+    if (uring_ && (client->armed || client->polling)) {
+        if (!client->closing) {
+            client->closing = true;
+            cancel_io(client);
+        }
+        return;
+    }
+
+    client->log_compression_stats();
+    if (!uring_) {
+        count_syscall();
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    ::close(fd);
+    spdlog::info("Client disconnected");
+    release_client(client);
+}
+
+opc_server::Client* opc_server::acquire_client(int fd, std::string address)
+{
+    Client* client;
+    if (free_clients_.empty()) {
+        client_pool_.emplace_back(new Client(*this));
+        client = client_pool_.back().get();
+    } else {
+        client = free_clients_.back();
+        free_clients_.pop_back();
+    }
+
+    if (clients_.size() <= static_cast<size_t>(fd)) {
+        clients_.resize(fd + 1, nullptr);
+    }
+    clients_[fd] = client;
+    client->open(fd, std::move(address));
+    return client;
+}
+
+void opc_server::release_client(Client* client)
+{
+    if (static_cast<size_t>(client->get_fd()) < clients_.size()) {
+        clients_[client->get_fd()] = nullptr;
+    }
+    client->release();
+    free_clients_.push_back(client);
+}
+
+void opc_server::watch_output(Client* client)
+{
+    if (uring_) {
+        arm_poll_out(client);
+        return;
+    }
+
+    // Input is ignored from now on, only wait for room in the socket buffer
+    epoll_event ev{};
+    ev.events = EPOLLOUT;
+    ev.data.ptr = client;
+    count_syscall();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, client->get_fd(), &ev) != 0) {
+        spdlog::warn("Could not watch client socket: {}", strerror(errno));
+    }
+}
+
+void opc_server::read_datagrams(int sock)
+{
+    mmsghdr msgs[udp_batch_size];
+    iovec iovecs[udp_batch_size];
+    sockaddr_in addresses[udp_batch_size];
+
+    for (size_t i = 0; i < udp_batch_size; i++) {
+        iovecs[i].iov_base = udp_buffer_.data() + i * udp_datagram_size;
+        iovecs[i].iov_len = udp_datagram_size;
+        msgs[i].msg_hdr = {};
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addresses[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now - udp_senders_swept_ > udp_sender_timeout) {
+        forget_udp_senders(now);
+    }
+
+    // Drain the socket, up to udp_batch_size datagrams per syscall
+    while (true) {
+        int n = recvmmsg(sock, msgs, udp_batch_size, MSG_DONTWAIT, nullptr);
+        count_syscall();
+        if (n <= 0) {
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            auto packet = static_cast<uint8_t*>(iovecs[i].iov_base);
+            size_t len = msgs[i].msg_len;
+            stats_.bytes.fetch_add(len, std::memory_order_relaxed);
+
+            if (len < 4) {
+                continue;
+            }
+
+            uint16_t payload_length = ((packet[2] << 8) | packet[3]);
+            if (len < 4u + payload_length) {
+                continue;
+            }
+
+            // Optional big endian sequence number following the OPC message
+            if (len == 8u + payload_length) {
+                const uint8_t* p = packet + 4 + payload_length;
+                uint32_t sequence = (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+                uint64_t source = (static_cast<uint64_t>(addresses[i].sin_addr.s_addr) << 16) | addresses[i].sin_port;
+
+                auto it = udp_senders_.find(source);
+                if (it != udp_senders_.end()) {
+                    auto delta = static_cast<int32_t>(sequence - it->second.sequence);
+                    // Late or duplicate datagram, unless the sender restarted
+                    if (delta <= 0 && delta > -udp_sequence_window) {
+                        continue;
+                    }
+                    it->second = { sequence, now };
+                } else if (udp_senders_.size() < udp_max_senders) {
+                    udp_senders_.emplace(source, udp_sender{ sequence, now });
                 }
             }
+
+            call_handler(nullptr, payload_length, packet);
+        }
+
+        if (n < static_cast<int>(udp_batch_size)) {
+            return;
+        }
+    }
+}
+
+void opc_server::forget_udp_senders(std::chrono::steady_clock::time_point now)
+{
+    for (auto it = udp_senders_.begin(); it != udp_senders_.end();) {
+        if (now - it->second.seen > udp_sender_timeout) {
+            it = udp_senders_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    udp_senders_swept_ = now;
+}
+
+void opc_server::notify_presented(uint32_t frame, uint64_t timestamp)
+{
+    {
+        std::lock_guard<std::mutex> lock(presented_mutex_);
+        presented_frame_ = frame;
+        presented_time_ = timestamp;
+    }
+
+    uint64_t one = 1;
+    if (running_ && ::write(wake_fd_, &one, sizeof(one)) < 0) {
+        spdlog::warn("Could not wake up the server thread: {}", strerror(errno));
+    }
+}
+
+void opc_server::schedule(std::chrono::steady_clock::time_point time)
+{
+    if (time == timer_) {
+        return;
+    }
+    timer_ = time;
+
+    // An absolute time of 0 would disarm the timer, past times fire at once
+    itimerspec spec{};
+    if (time != std::chrono::steady_clock::time_point::max()) {
+        auto ns = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count());
+        spec.it_value.tv_sec = ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+    }
+    count_syscall();
+    if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) {
+        spdlog::warn("Could not arm the timer: {}", strerror(errno));
+    }
+}
+
+void opc_server::handle_timer()
+{
+    uint64_t expirations;
+    count_syscall();
+    if (::read(timer_fd_, &expirations, sizeof(expirations)) <= 0 || !running_) {
+        return;
+    }
+    timer_ = std::chrono::steady_clock::time_point::max();
+    if (timer_handler_) {
+        timer_handler_();
+    }
+}
+
+void opc_server::send_presented()
+{
+    uint32_t frame;
+    uint64_t timestamp;
+    {
+        std::lock_guard<std::mutex> lock(presented_mutex_);
+        frame = presented_frame_;
+        timestamp = presented_time_;
+    }
+
+    if (frame == sent_frame_) {
+        return;
+    }
+    sent_frame_ = frame;
+
+    // OPC system exclusive message on channel 0: 0x06, then the frame counter
+    // and the timestamp in microseconds, big endian
+    uint8_t message[4 + 13] = { 0, static_cast<uint8_t>(opc_command::system_exclusive), 0, 13, 0x06 };
+    for (int i = 0; i < 4; i++) {
+        message[5 + i] = frame >> (24 - 8 * i);
+    }
+    for (int i = 0; i < 8; i++) {
+        message[9 + i] = timestamp >> (56 - 8 * i);
+    }
+
+    std::vector<int> closed;
+    for (auto client : clients_) {
+        if (client && client->presented && !client->closing) {
+            count_syscall();
+            if (!client->send(message, sizeof(message))) {
+                closed.push_back(client->get_fd());
+            }
         }
     }
+    for (int fd : closed) {
+        close_client(fd);
+    }
 }
 
-void opc_server::call_handler(uint16_t payload_len, uint8_t* opc_packet)
+std::string opc_server::metrics() const
 {
+    std::string out;
+    write_metric(out, "epilepsia_opc_messages_total", "OPC messages received", "counter", stats_.messages.load(std::memory_order_relaxed));
+    write_metric(out, "epilepsia_received_bytes_total", "Bytes received over TCP and UDP", "counter", stats_.bytes.load(std::memory_order_relaxed));
+    write_metric(out, "epilepsia_server_syscalls_total", "System calls made by the server thread", "counter", stats_.syscalls.load(std::memory_order_relaxed));
+    write_metric(out, "epilepsia_connections_total", "TCP connections accepted", "counter", stats_.connections.load(std::memory_order_relaxed));
+    write_metric(out, "epilepsia_connections", "Open TCP connections", "gauge", client_pool_.size() - free_clients_.size());
+
+    // Per client counters, reset when the connection is closed
+    out += "# HELP epilepsia_client_messages_total OPC messages received per client\n"
+           "# TYPE epilepsia_client_messages_total counter\n";
+    for (auto client : clients_) {
+        if (client) {
+            out += fmt::format("epilepsia_client_messages_total{{client=\"{}\"}} {}\n", client->address, client->messages);
+        }
+    }
+    out += "# HELP epilepsia_client_received_bytes_total Bytes received per client\n"
+           "# TYPE epilepsia_client_received_bytes_total counter\n";
+    for (auto client : clients_) {
+        if (client) {
+            out += fmt::format("epilepsia_client_received_bytes_total{{client=\"{}\"}} {}\n", client->address, client->bytes);
+        }
+    }
+
+    if (metrics_handler_) {
+        metrics_handler_(out);
+    }
+    return out;
+}
+
+void opc_server::call_handler(Client* client, uint16_t payload_len, uint8_t* opc_packet)
+{
+    // Subscription to frame presented messages, handled by the server itself
+    if (opc_packet[1] == static_cast<int>(opc_command::system_exclusive) && payload_len == 2 && opc_packet[4] == 0x06) {
+        if (client) {
+            client->presented = opc_packet[5];
+        }
+        return;
+    }
+
+    stats_.messages.fetch_add(1, std::memory_order_relaxed);
+    if (client) {
+        client->messages++;
+    }
     if (opc_packet[1] == static_cast<int>(opc_command::set_pixels)) {
         handlers_[0](opc_packet[0], payload_len, opc_packet + 4);
+    } else if (opc_packet[1] == static_cast<int>(opc_command::set_pixels_16)) {
+        if (handlers_[1]) {
+            handlers_[1](opc_packet[0], payload_len, opc_packet + 4);
+        }
     } else if (opc_packet[1] == static_cast<int>(opc_command::system_exclusive)) {
-        handlers_[1](opc_packet[0], payload_len, opc_packet + 4);
+        handlers_[2](opc_packet[0], payload_len, opc_packet + 4);
     }
 }
 
+void opc_server::Client::open(int fd_, std::string address_)
+{
+    fd = fd_;
+    address = std::move(address_);
+    messages = bytes = 0;
+    state = client_state::new_connection;
+    parsed = received = 0;
+    presented = false;
+    armed = polling = closing = false;
+    inflater.reset();
+    inflated = std::vector<uint8_t>();
+    output = std::string();
+
+    // Give back the memory of a buffer grown by a previous connection
+    if (buffer.size() != client_buffer_size) {
+        buffer = std::vector<uint8_t>(client_buffer_size);
+    }
+}
+
+bool opc_server::Client::make_room()
+{
+    if (received == buffer.size()) {
+        if (parsed > 0) {
+            // Move the incomplete message at the end of the buffer to the front
+            std::copy(buffer.begin() + parsed, buffer.begin() + received, buffer.begin());
+            received -= parsed;
+            parsed = 0;
+        } else if (buffer.size() < static_cast<size_t>(server_.settings_.max_message_size)) {
+            // The buffer only holds part of a message
+            buffer.resize(std::min<size_t>(buffer.size() * 2, server_.settings_.max_message_size));
+        }
+    }
+
+    if (received == buffer.size()) {
+        spdlog::warn("Message larger than {} bytes", server_.settings_.max_message_size);
+        return false;
+    }
+
+    return true;
+}
+
 bool opc_server::Client::read()
 {
-    if (state == client_state::opc) {
-        return handle_opc();
-    } else if (state == client_state::websocket) {
-        return handle_websocket_data();
+    // Drain the socket with large reads and parse every complete message
+    // before going back to epoll.
+    while (true) {
+        if (!make_room()) {
+            return false;
+        }
+
+        size_t space = buffer.size() - received;
+        server_.count_syscall();
+        ssize_t len = recv(fd, buffer.data() + received, space, 0);
+        if (len <= 0) {
+            // IO error or client shutdown, or nothing left to read
+            return !io_error(len);
+        }
+
+        received += len;
+        bytes += len;
+        server_.stats_.bytes.fetch_add(len, std::memory_order_relaxed);
+        if (!parse()) {
+            return false;
+        }
+
+        if (parsed == received) {
+            parsed = received = 0;
+        }
+
+        // A short read means the socket has been drained
+        if (static_cast<size_t>(len) < space) {
+            return true;
+        }
     }
+}
 
-    // We use the first 4 bytes to demultiplex OPC and websocket clients
-    if (received < 4) {
-        ssize_t len = recv(fd, buffer.data(), 4 - received, 0);
-        if (len > 0) {
-            received += len;
-        } else {
-            // IO error or client shutdown
+bool opc_server::Client::feed(const uint8_t* data, size_t len)
+{
+    bytes += len;
+    server_.stats_.bytes.fetch_add(len, std::memory_order_relaxed);
+
+    while (len > 0) {
+        if (!make_room()) {
             return false;
         }
+
+        size_t n = std::min(len, buffer.size() - received);
+        std::copy_n(data, n, buffer.begin() + received);
+        received += n;
+        data += n;
+        len -= n;
+
+        if (!parse()) {
+            return false;
+        }
+
+        if (parsed == received) {
+            parsed = received = 0;
+        }
+    }
+
+    return true;
+}
+
+bool opc_server::Client::send(const uint8_t* message, size_t len)
+{
+    // Websocket clients get the message in an unmasked binary frame
+    uint8_t header[2] = { 0x82, static_cast<uint8_t>(len) };
+    iovec iov[2] = { { header, 2 }, { const_cast<uint8_t*>(message), len } };
+    msghdr msg{};
+    msg.msg_iov = state == client_state::websocket ? iov : iov + 1;
+    msg.msg_iovlen = state == client_state::websocket ? 2 : 1;
+
+    size_t expected = len + (state == client_state::websocket ? 2 : 0);
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    // The client does not keep up, skip this message
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+
+    // A partial message would desynchronize the stream
+    return sent == static_cast<ssize_t>(expected);
+}
+
+bool opc_server::Client::flush()
+{
+    server_.count_syscall();
+    ssize_t sent = ::send(fd, output.data(), output.size(), MSG_NOSIGNAL);
+    if (sent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    output.erase(0, sent);
+    return !output.empty();
+}
+
+bool opc_server::Client::parse()
+{
+    if (state == client_state::replying) {
+        parsed = received;
+        return true;
     }
 
-    if (received == 4) {
+    if (state == client_state::new_connection) {
+        // We use the first 4 bytes to demultiplex OPC and websocket clients
+        if (received - parsed < 4) {
+            return true;
+        }
+
         const std::array<uint8_t, 4> a = { 'G', 'E', 'T', ' ' };
-        if (std::equal(std::begin(a), std::end(a), std::begin(buffer))) {
+        if (std::equal(std::begin(a), std::end(a), buffer.begin() + parsed)) {
             spdlog::info("Protocol: Websocket");
             state = client_state::websocket_handshake;
-            return handle_websocket_handshake();
         } else {
             spdlog::info("Protocol: OPC");
             state = client_state::opc;
-            return handle_opc();
         }
     }
 
+    if (state == client_state::websocket_handshake) {
+        if (!handle_websocket_handshake()) {
+            return false;
+        }
+    }
+
+    if (state == client_state::opc) {
+        return handle_opc();
+    } else if (state == client_state::websocket) {
+        return handle_websocket_data();
+    }
+
     return true;
 }
 
 bool opc_server::Client::handle_opc()
 {
-    ssize_t len = 0;
+    while (received - parsed >= 4) {
+        uint8_t* packet = buffer.data() + parsed;
+        uint16_t payload_length = ((packet[2] << 8) | packet[3]);
 
-    if (!payload_length) {
-        if (received < 4) {
-            len = recv(fd, buffer.data(), 4 - received, 0);
-            if (len > 0) {
-                received += len;
-            } else {
-                return false;
-            }
+        // Payload incomplete
+        if (received - parsed < 4u + payload_length) {
+            break;
         }
 
-        // Header complete
-        if (received == 4) {
-            payload_length = ((buffer[2] << 8) | buffer[3]);
-            received = 0;
+        server_.call_handler(this, payload_length, packet);
+        parsed += 4 + payload_length;
+    }
+
+    return true;
+}
+
+bool opc_server::Client::handle_websocket_handshake()
+{
+    char* buf = reinterpret_cast<char*>(buffer.data());
+    auto sbuf = std::string(buf + parsed, received - parsed);
+    auto end = sbuf.find("\r\n\r\n");
+
+    // We have not received all the headers of the HTTP GET yet
+    if (end == std::string::npos) {
+        if (received == static_cast<size_t>(server_.settings_.max_message_size) && parsed == 0) {
+            spdlog::warn("HTTP request too large");
+            return false;
         }
+        return true;
     }
 
-    if (payload_length > 0) {
-        if (received < payload_length) {
-            len = recv(fd, buffer.data() + 4 + received, payload_length - received, 0);
-            if (len > 0) {
-                received += len;
-            }
+    std::istringstream sstream(sbuf.substr(0, end + 4));
+    std::string line;
+    std::map<std::string, std::string> headers;
+
+    // Method and HTTP version
+    std::getline(sstream, line);
+
+    // Prometheus scrape, answered on the same port then closed
+    if (line.compare(0, 13, "GET /metrics ") == 0) {
+        auto body = server_.metrics();
+        auto reply = fmt::format("HTTP/1.1 200 OK\r\n"
+                                 "Server: epilepsia\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: {}\r\n"
+                                 "Connection: close\r\n\r\n",
+            body.size());
+        output = std::move(reply) + body;
+        if (!flush()) {
+            return false;
         }
 
-        // Payload complete
-        if (received == payload_length) {
-            server_.call_handler(payload_length, buffer.data());
-            received = 0;
-            payload_length = 0;
+        // The rest is sent when the socket buffer drains
+        state = client_state::replying;
+        parsed = received;
+        server_.watch_output(this);
+        return true;
+    }
+
+    // Parse HTTP headers
+    // TODO: check Origin
+    while (std::getline(sstream, line)) {
+        if (line.length() > 3) {
+            line.pop_back(); // Remove trailling \r
+            auto i = line.find(":");
+            headers.emplace(line.substr(0, i), line.substr(i + 2)); // TODO: header needs better trimming
         }
     }
 
-    if (len <= 0) {
-        // IO error or client shutdown
-        return false;
+    for (auto& i : headers) {
+        std::cout << i.first << ":" << i.second << std::endl;
+    }
+
+    // Compute challenge
+    using namespace std::string_literals;
+    std::string key = headers["Sec-WebSocket-Key"s];
+    char result[SHA1_BASE64_SIZE];
+    sha1((key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"s).c_str()).finalize().print_base64(result);
+
+    auto reply = "HTTP/1.1 101 Switching Protocols\r\n"
+                 "Server: epilepsia\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: "s;
+
+    reply += std::string(result);
+
+    // permessage-deflate, with a bounded window
+    auto extensions = headers.find("Sec-WebSocket-Extensions"s);
+    if (server_.settings_.websocket_deflate && extensions != headers.end()) {
+        websocket_deflate_params params;
+        std::string response;
+        if (websocket_negotiate_deflate(extensions->second, server_.settings_.deflate_window_bits, params, response)) {
+            inflater.reset(new websocket_inflater(params));
+            // An inflated message is an OPC message no larger than max_message_size,
+            // the extra byte tells larger ones apart
+            inflated.resize(std::min(server_.settings_.max_message_size, 4 + 0xFFFF) + 1);
+            reply += "\r\nSec-WebSocket-Extensions: " + response;
+            spdlog::info("Websocket compression: {}", response);
+        }
     }
 
+    reply += "\r\n\r\n";
+
+    std::cout << reply << std::endl;
+
+    // Send HTTP response to client and switch to websocket
+    server_.count_syscall();
+    ::send(fd, reply.c_str(), reply.length(), 0);
+    state = client_state::websocket;
+    parsed += end + 4;
+
     return true;
 }
 
-bool opc_server::Client::handle_websocket_handshake()
+bool opc_server::Client::handle_websocket_data()
 {
-    char* buf = reinterpret_cast<char*>(buffer.data());
-    ssize_t len = recv(fd, buf + received, buffer.size() - received, 0);
+    while (received - parsed >= 2) {
+        uint8_t* frame = buffer.data() + parsed;
+        size_t available = received - parsed;
 
-    if (len > 0) {
-        received += len;
-        auto sbuf = std::string(buf, received);
-
-        // We have received all the headers of the HTTP GET
-        if (sbuf.find("\r\n\r\n") != std::string::npos) {
-            std::istringstream sstream(sbuf);
-            std::string line;
-            std::map<std::string, std::string> headers;
-
-            // Method and HTTP version
-            std::getline(sstream, line);
-
-            // Parse HTTP headers
-            // TODO: check Origin
-            while (std::getline(sstream, line)) {
-                if (line.length() > 3) {
-                    line.pop_back(); // Remove trailling \r
-                    auto i = line.find(":");
-                    headers.emplace(line.substr(0, i), line.substr(i + 2)); // TODO: header needs better trimming
-                }
-            }
+        // TODO: MASK bit should be one
+        // TODO: handle message fragmentation
+        uint8_t opcode = frame[0] & 0x0F;
+        uint8_t fin = frame[0] >> 7;
+        bool compressed = frame[0] & 0x40;
+        uint8_t length = frame[1] & 0x7F;
+
+        // RSV1 is only allowed if permessage-deflate was negotiated
+        if (compressed && !inflater) {
+            return false;
+        }
+
+        // Either text mode or fragmented packet
+        if (opcode != 2 || fin == 0) {
+            std::cout << "Wrong opcode: " << opcode << std::endl;
+            return false;
+        }
 
-            for (auto& i : headers) {
-                std::cout << i.first << ":" << i.second << std::endl;
+        size_t header_length = 6;
+        size_t payload_length = length;
+
+        if (length == 126) {
+            if (available < 4) {
+                break;
             }
+            header_length = 8;
+            payload_length = ((frame[2] << 8) | frame[3]);
+        } else if (length == 127) {
+            //Not supported. Probably not needed.
+            std::cout << "Wow much bytes!" << std::endl;
+            return false;
+        }
 
-            // Compute challenge
-            using namespace std::string_literals;
-            std::string key = headers["Sec-WebSocket-Key"s];
-            char result[SHA1_BASE64_SIZE];
-            sha1((key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"s).c_str()).finalize().print_base64(result);
+        // Frame incomplete
+        if (available < header_length + payload_length) {
+            break;
+        }
 
-            auto reply = "HTTP/1.1 101 Switching Protocols\r\n"
-                         "Server: epilepsia\r\n"
-                         "Upgrade: websocket\r\n"
-                         "Connection: Upgrade\r\n"
-                         "Sec-WebSocket-Accept: "s;
+        // Should contain at least an OPC header
+        if (payload_length < 4) {
+            return false;
+        }
 
-            reply += std::string(result);
-            reply += "\r\n\r\n";
+        // Unmask payload
+        const uint8_t* masking_key = frame + header_length - 4;
+        uint8_t* payload = frame + header_length;
+        websocket_unmask(payload, payload_length, masking_key);
 
-            std::cout << reply << std::endl;
+        if (compressed) {
+            int len = inflater->inflate(payload, payload_length, inflated.data(), inflated.size());
+            if (len < 4 || len == static_cast<int>(inflated.size())) {
+                spdlog::warn("Could not inflate websocket message, corrupted or larger than {} bytes", inflated.size() - 1);
+                return false;
+            }
+            server_.call_handler(this, len - 4, inflated.data());
 
-            // Send HTTP response to client and switch to websocket
-            ::send(fd, reply.c_str(), reply.length(), 0);
-            state = client_state::websocket;
-            received = 0;
+            if (inflater->messages() % 1000 == 0) {
+                log_compression_stats();
+            }
+        } else {
+            server_.call_handler(this, payload_length - 4, payload);
         }
 
-        return true;
+        parsed += header_length + payload_length;
+    }
 
-    } else {
-        // IO error or client shutdown
+    return true;
+}
+
+void opc_server::Client::log_compression_stats() const
+{
+    if (!inflater || !inflater->messages()) {
+        return;
+    }
+
+    spdlog::debug("Client {}: compression ratio {:.2f}, {:.1f} us per inflate", fd,
+        static_cast<double>(inflater->inflated_bytes()) / inflater->compressed_bytes(),
+        std::chrono::duration<double, std::micro>(inflater->inflate_time()).count() / inflater->messages());
+}
+
+#ifdef EPILEPSIA_IO_URING
+
+bool opc_server::setup_uring()
+{
+    if (!io_uring_queue::supported()) {
         return false;
     }
+
+    std::unique_ptr<io_uring_queue> ring(new io_uring_queue);
+    if (!ring->init(uring_entries) || !ring->register_buffers(0, uring_buffer_count, uring_buffer_size)) {
+        return false;
+    }
+    uring_ = std::move(ring);
+
+    // Everything is multishot, armed once and rearmed only if the kernel ends it
+    arm_poll(wake_fd_, user_data(tag_wake, 0));
+    arm_poll(timer_fd_, user_data(tag_timer, 0));
+    for (size_t i = 0; i < listen_socks_.size(); i++) {
+        arm_accept(i);
+    }
+    for (size_t i = 0; i < udp_socks_.size(); i++) {
+        arm_poll(udp_socks_[i], user_data(tag_udp, i));
+    }
+
+    return true;
 }
 
-bool opc_server::Client::handle_websocket_data()
+void opc_server::run_uring()
 {
-    ssize_t len = 0;
+    while (running_) {
+        // Submit what the previous completions queued and wait for more, one syscall
+        count_syscall();
+        if (uring_->submit(1) < 0 && errno != EINTR && errno != EBUSY) {
+            spdlog::error("io_uring_enter failed: {}", strerror(errno));
+        }
 
-    // Receive packet header to get payload length and masking key
-    if (!payload_length) {
-        if (received < 6) {
-            len = recv(fd, buffer.data() + received, 6 - received, 0);
-            if (len > 0) {
-                received += len;
-            }
+        uring_->for_each_cqe([this](const io_uring_cqe& cqe) {
+            handle_completion(cqe);
+        });
+    }
+}
+
+void opc_server::handle_completion(const io_uring_cqe& cqe)
+{
+    const auto tag = static_cast<uring_tag>(cqe.user_data >> uring_tag_shift);
+    const uint64_t value = cqe.user_data & ((1ull << uring_tag_shift) - 1);
+    const bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    switch (tag) {
+    case tag_client:
+        handle_client_completion(reinterpret_cast<Client*>(static_cast<uintptr_t>(value)), cqe);
+        break;
+
+    case tag_wake: {
+        // stop() was called, or a frame has been presented
+        uint64_t count;
+        count_syscall();
+        if (::read(wake_fd_, &count, sizeof(count)) > 0 && running_) {
+            send_presented();
+        }
+        if (!more) {
+            arm_poll(wake_fd_, cqe.user_data);
         }
+        break;
+    }
 
-        if (received >= 6) {
-            // TODO: MASK bit should be one
-            // TODO: handle message fragmentation
-            uint8_t opcode = buffer[0] & 0x0F;
-            uint8_t fin = buffer[0] >> 7;
-            uint8_t length = buffer[1] & 0x7F;
-            
-            // Either text mode or fragmented packet
-            if (opcode != 2 || fin == 0) {
-                std::cout << "Wrong opcode: " << opcode << std::endl;
-                return false;
-            }
+    case tag_timer:
+        handle_timer();
+        if (!more) {
+            arm_poll(timer_fd_, cqe.user_data);
+        }
+        break;
 
-            if (length == 126) {
-                len = recv(fd, buffer.data() + received, 8 - received, 0);
-                if (len > 0) {
-                    received += len;
-                }
-                if (received == 8) {
-                    payload_length = ((buffer[2] << 8) | buffer[3]);
-                    std::copy_n(buffer.begin() + 4, 4, masking_key_.begin());
-                    received = 0;
-                }
-            } else if (length == 127) {
-                //Not supported. Probably not needed.
-                std::cout << "Wow much bytes!" << std::endl;
-                return false;
-            } else {
-                payload_length = length;
-                std::copy_n(buffer.begin() + 2, 4, masking_key_.begin());
-                received = 0;
-            }
+    case tag_accept:
+        if (cqe.res >= 0) {
+            sockaddr_in address{};
+            socklen_t address_len = sizeof(address);
+            getpeername(cqe.res, (sockaddr*)&address, &address_len);
+            add_client(cqe.res, address);
+        } else if (cqe.res != -ECANCELED) {
+            spdlog::warn("accept failed: {}", strerror(-cqe.res));
+        }
+        if (!more) {
+            arm_accept(value);
+        }
+        break;
+
+    case tag_udp:
+        read_datagrams(udp_socks_[value]);
+        if (!more) {
+            arm_poll(udp_socks_[value], cqe.user_data);
+        }
+        break;
+
+    case tag_output: {
+        auto client = reinterpret_cast<Client*>(static_cast<uintptr_t>(value));
+        client->polling = false;
+        if (client->closing || cqe.res < 0 || !client->flush()) {
+            close_client(client->get_fd());
+        } else {
+            arm_poll_out(client);
         }
+        break;
     }
 
-    if (payload_length > 0) {
+    case tag_cancel:
+        break;
+    }
+}
 
-        // Receive payload
-        if (received < payload_length) {
-            len = recv(fd, buffer.data() + received, payload_length - received, 0);
-            if (len > 0) {
-                // Unmask payload
-                for (size_t i = received; i < received + len; i++) {
-                    buffer[i] = buffer[i] ^ masking_key_[i % 4];
-                }
-                received += len;
-            }
+void opc_server::handle_client_completion(Client* client, const io_uring_cqe& cqe)
+{
+    // While replying, the end of the input does not close the client
+    bool ok = cqe.res > 0 || client->replying();
+
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (ok && !client->closing) {
+            ok = client->feed(uring_->buffer(id), cqe.res);
         }
+        uring_->recycle_buffer(id);
+    }
+
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        client->armed = false;
+    }
 
-        // Payload received
-        if (received == payload_length) {
-            server_.call_handler(payload_length - 4, buffer.data());
-            received = 0;
-            payload_length = 0;
+    // Running out of provided buffers just ends the multishot receive
+    if (client->closing || (!ok && cqe.res != -ENOBUFS)) {
+        if (!client->closing || !client->armed) {
+            close_client(client->get_fd());
         }
+        return;
     }
 
-    // IO error or client shutdown
-    if (len <= 0) {
-        return false;
+    if (!client->armed && !client->replying()) {
+        arm_recv(client);
     }
+}
 
-    return true;
+void opc_server::arm_accept(size_t index)
+{
+    io_uring_sqe* sqe = uring_->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_socks_[index];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data(tag_accept, index);
+}
+
+void opc_server::arm_poll(int fd, uint64_t data)
+{
+    io_uring_sqe* sqe = uring_->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = data;
 }
 
-} // namespace epilepsia
\ No newline at end of file
+void opc_server::arm_recv(Client* client)
+{
+    io_uring_sqe* sqe = uring_->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->get_fd();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data(tag_client, reinterpret_cast<uintptr_t>(client));
+    client->armed = true;
+}
+
+void opc_server::arm_poll_out(Client* client)
+{
+    io_uring_sqe* sqe = uring_->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->get_fd();
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = user_data(tag_output, reinterpret_cast<uintptr_t>(client));
+    client->polling = true;
+}
+
+void opc_server::cancel_io(Client* client)
+{
+    for (auto tag : { tag_client, tag_output }) {
+        if (tag == tag_client ? client->armed : client->polling) {
+            io_uring_sqe* sqe = uring_->get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = user_data(tag, reinterpret_cast<uintptr_t>(client));
+            sqe->user_data = user_data(tag_cancel, 0);
+        }
+    }
+}
+
+#else
+
+bool opc_server::setup_uring() { return false; }
+void opc_server::run_uring() {}
+void opc_server::handle_completion(const io_uring_cqe&) {}
+void opc_server::handle_client_completion(Client*, const io_uring_cqe&) {}
+void opc_server::arm_accept(size_t) {}
+void opc_server::arm_poll(int, uint64_t) {}
+void opc_server::arm_recv(Client*) {}
+void opc_server::arm_poll_out(Client*) {}
+void opc_server::cancel_io(Client*) {}
+
+#endif // EPILEPSIA_IO_URING
+
+} // namespace epilepsia
@@ -17,27 +17,71 @@
 #ifndef EPILEPSIAOPCSERVER_H
 #define EPILEPSIAOPCSERVER_H
 
+#include "websocket.hpp"
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <initializer_list>
-#include <map>
+#include <memory>
+#include <mutex>
 #include <cstdint>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+struct io_uring_cqe;
+struct sockaddr_in;
+
 namespace epilepsia {
 
+class io_uring_queue;
+
 enum class opc_command {
     set_pixels = 0,
+    set_pixels_16 = 2, // 16 bits per channel, big endian
     system_exclusive = 0xFF
 };
 
+enum class io_backend {
+    epoll,
+    // Falls back to epoll if the kernel is too old
+    io_uring
+};
+
+struct opc_server_settings {
+    std::vector<uint16_t> ports;
+    bool udp{ false };
+    bool websocket_deflate{ false };
+    int deflate_window_bits{ 15 };
+    // Receive buffers of TCP clients grow up to that size, which must fit
+    // the largest OPC message or websocket frame clients send.
+    int max_message_size{ (1 << 16) + 8 };
+    io_backend backend{ io_backend::epoll };
+};
+
+struct opc_server_stats {
+    // OPC messages handled
+    std::atomic<uint64_t> messages{ 0 };
+    // Bytes received over TCP and UDP
+    std::atomic<uint64_t> bytes{ 0 };
+    // TCP connections accepted
+    std::atomic<uint64_t> connections{ 0 };
+    // System calls made by the server thread
+    std::atomic<uint64_t> syscalls{ 0 };
+};
+
 class opc_server {
 public:
-    using Handler = std::function<void(uint8_t, uint16_t, uint8_t*)>;
+    using Handler = std::function<void(uint8_t, uint16_t, const uint8_t*)>;
+    // Appends metrics of other components in Prometheus text format
+    using MetricsHandler = std::function<void(std::string&)>;
+    using TimerHandler = std::function<void()>;
 
     explicit opc_server(std::initializer_list<uint16_t> ports);
-    explicit opc_server(const std::vector<uint16_t>& ports);
+    explicit opc_server(const opc_server_settings& settings);
+    ~opc_server();
 
     opc_server(opc_server const&) = delete;
     opc_server& operator=(opc_server const&) = delete;
@@ -48,22 +92,113 @@ public:
     template <opc_command command, typename T>
     void set_handler(T&& handler) noexcept
     {
-        handlers_[command == opc_command::set_pixels ? 0 : 1] = handler;
+        handlers_[command == opc_command::set_pixels ? 0 : command == opc_command::set_pixels_16 ? 1 : 2] = handler;
+    }
+
+    /**
+     * Tell subscribed clients that a frame has been handed to the PRUs.
+     * Can be called from any thread, the message is sent by the server thread.
+     */
+    void notify_presented(uint32_t frame, uint64_t timestamp);
+
+    /**
+     * HTTP GET /metrics is answered with the server metrics followed by
+     * the ones appended by this handler, called from the server thread.
+     * Must be set before start().
+     */
+    template <typename T>
+    void set_metrics_handler(T&& handler) noexcept
+    {
+        metrics_handler_ = handler;
+    }
+
+    /**
+     * Called from the server thread at the time passed to schedule().
+     * Must be set before start().
+     */
+    template <typename T>
+    void set_timer_handler(T&& handler) noexcept
+    {
+        timer_handler_ = handler;
     }
 
+    /**
+     * Call the timer handler at time, replacing the previous one, or never
+     * for time_point::max(). Only from the server thread, i.e. the handlers.
+     */
+    void schedule(std::chrono::steady_clock::time_point time);
+
+    const opc_server_stats& stats() const { return stats_; }
+
 private:
     void run();
+    void run_epoll();
+    void run_uring();
     bool listen();
-    void call_handler(uint16_t payload_len, uint8_t *opc_packet);
+    bool setup_uring();
+    int bind_socket(int type, uint16_t port);
+    void close_sockets();
+    void accept_client(int listen_sock);
+    void add_client(int sock, const sockaddr_in& address);
+    void close_client(int fd);
+    void read_datagrams(int sock);
+    void forget_udp_senders(std::chrono::steady_clock::time_point now);
+    void send_presented();
+    void handle_timer();
+    std::string metrics() const;
+
+    class Client;
+    void call_handler(Client* client, uint16_t payload_len, uint8_t* opc_packet);
+    void watch_output(Client* client);
+    void count_syscall() { stats_.syscalls.fetch_add(1, std::memory_order_relaxed); }
+
+    // io_uring backend
+    void handle_completion(const io_uring_cqe& cqe);
+    void handle_client_completion(Client* client, const io_uring_cqe& cqe);
+    void arm_accept(size_t index);
+    void arm_poll(int fd, uint64_t user_data);
+    void arm_recv(Client* client);
+    void arm_poll_out(Client* client);
+    void cancel_io(Client* client);
 
     class Client {
     public:
-        Client(int& fd_, opc_server& opc_server)
-            : fd(fd_), server_(opc_server) {}
+        explicit Client(opc_server& opc_server)
+            : server_(opc_server) {}
 
+        Client(Client const&) = delete;
+        Client& operator=(Client const&) = delete;
+
+        // Clients are recycled, open() resets everything but the buffer
+        void open(int fd_, std::string address_);
+        void release() { fd = -1; }
         bool read();
+        // Same as read(), with data received by other means
+        bool feed(const uint8_t* data, size_t len);
+        bool send(const uint8_t* message, size_t len);
+        // Send more of a reply that did not fit in the socket buffer. Returns
+        // false once it has all been sent, or on error: the client is then closed.
+        bool flush();
+        bool replying() const { return state == client_state::replying; }
+        int get_fd() const { return fd; }
+        void log_compression_stats() const;
+
+        // Opted in for frame presented messages
+        bool presented{ false };
+        // io_uring: a multishot receive is pending, a poll for writing is
+        // pending, and they are being cancelled
+        bool armed{ false };
+        bool polling{ false };
+        bool closing{ false };
+
+        // Only touched by the server thread
+        std::string address;
+        uint64_t messages{ 0 };
+        uint64_t bytes{ 0 };
 
     private:
+        bool make_room();
+        bool parse();
         bool handle_opc();
         bool handle_websocket_handshake();
         bool handle_websocket_data();
@@ -72,24 +207,76 @@ private:
             new_connection,
             websocket_handshake,
             websocket,
-            opc
+            opc,
+            // Input is ignored until the reply is sent, then the client is closed
+            replying
         };
         client_state state{ client_state::new_connection };
 
-        int fd;
-        std::array<uint8_t, (1 << 16) + 4> buffer;
-        std::array<uint8_t, 4> masking_key_;
+        int fd{ -1 };
+        // Grows with the messages received, up to max_message_size
+        std::vector<uint8_t> buffer;
+        size_t parsed{ 0 };
         size_t received{ 0 };
-        uint16_t payload_length{ 0 };
         opc_server& server_;
+
+        // Only allocated if permessage-deflate has been negotiated
+        std::unique_ptr<websocket_inflater> inflater;
+        std::vector<uint8_t> inflated;
+
+        // What is left to send of a reply
+        std::string output;
     };
 
+    Client* acquire_client(int fd, std::string address);
+    void release_client(Client* client);
+
     std::thread thread_;
-    std::map<int, Client> clients_;
-    std::vector<uint16_t> ports_;
+    // Indexed by file descriptor, with released clients kept for reuse
+    std::vector<Client*> clients_;
+    std::vector<std::unique_ptr<Client>> client_pool_;
+    std::vector<Client*> free_clients_;
+    const opc_server_settings settings_;
     std::vector<int> listen_socks_;
+    std::vector<int> udp_socks_;
+    int epoll_fd_{ -1 };
+    int wake_fd_{ -1 };
+    int timer_fd_{ -1 };
+    std::chrono::steady_clock::time_point timer_{ std::chrono::steady_clock::time_point::max() };
+    std::unique_ptr<io_uring_queue> uring_;
+    opc_server_stats stats_;
     std::atomic<bool> running_{ false };
-    std::array<Handler, 2> handlers_;
+    std::array<Handler, 3> handlers_;
+    MetricsHandler metrics_handler_;
+    TimerHandler timer_handler_;
+
+    // Initial receive buffer of a client, grown on demand up to max_message_size
+    static constexpr size_t client_buffer_size = 4096;
+    static constexpr unsigned uring_entries = 256;
+    static constexpr unsigned uring_buffer_count = 32;
+    static constexpr size_t uring_buffer_size = 16384;
+    static constexpr size_t udp_batch_size = 8;
+    // An OPC message per datagram, optionally followed by a 32 bits sequence number
+    static constexpr size_t udp_datagram_size = (1 << 16) + 8;
+    static constexpr int32_t udp_sequence_window = 1024;
+    // Senders are forgotten when silent for that long, and not tracked past that many
+    static constexpr std::chrono::seconds udp_sender_timeout{ 10 };
+    static constexpr size_t udp_max_senders = 256;
+    std::vector<uint8_t> udp_buffer_;
+
+    struct udp_sender {
+        uint32_t sequence;
+        std::chrono::steady_clock::time_point seen;
+    };
+    // By address and port
+    std::unordered_map<uint64_t, udp_sender> udp_senders_;
+    std::chrono::steady_clock::time_point udp_senders_swept_;
+
+    // Last frame handed to the PRUs, and the last one sent to clients
+    std::mutex presented_mutex_;
+    uint32_t presented_frame_{ 0 };
+    uint64_t presented_time_{ 0 };
+    uint32_t sent_frame_{ 0 };
 };
 
 } // namespace epilepsia
@@ -83,6 +83,22 @@ void pru_driver::write_rproc_sysfs(int pru_id, const char* filename, const char*
     }
 }
 
+uint32_t* pru_driver::acquire_frame()
+{
+    auto start = std::chrono::steady_clock::now();
+    block_until_ready();
+    wait_time_.observe(std::chrono::steady_clock::now() - start);
+    return frame_;
+}
+
+void pru_driver::present_frame()
+{
+    // The PRU(s) start(s) shifting out the frame as soon as the flag is cleared
+    std::atomic_thread_fence(std::memory_order_release);
+    *flag_pru_ = 0;
+    frames_.fetch_add(1, std::memory_order_relaxed);
+}
+
 void pru_driver::block_until_ready()
 {
     int n = 0;
@@ -95,7 +111,6 @@ void pru_driver::block_until_ready()
             std::exit(EXIT_FAILURE);
         }
     }
-    *flag_pru_ = 0;
 }
 
 void pru_driver::halt()
@@ -17,9 +17,11 @@
 #ifndef EPILEPSIAPRUDRIVER_H
 #define EPILEPSIAPRUDRIVER_H
 
+#include "metrics.hpp"
 #include <spdlog/spdlog.h>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
-#include <algorithm>
 
 namespace epilepsia {
 
@@ -38,21 +40,20 @@ public:
     ~pru_driver();
 
     /**
-     * Block until the PRU(s) is/are ready to read a new frame,
-     * unlock the PRU(s) and write the new frame to the shared memory.
+     * Block until the PRU(s) is/are ready to read a new frame and return
+     * the frame buffer in the shared memory. The PRU(s) only read(s) it,
+     * so it still holds the previous frame. The memory is not cached:
+     * write it sequentially, with wide stores, and never read it.
      */
-    template <typename T>
-    void write_frame(T buffer, const int len)
-    {
-        if (len > 12 * 1024 - 4) {
-            // Warning buffer too big. Should not happen...
-            // Frame discarded
-            spdlog::warn("Frame too big, discarding it...");
-            return;
-        }
-        block_until_ready();
-        std::copy_n(buffer, len, reinterpret_cast<T>(frame_)); // 280us for 5760 bytes
-    }
+    uint32_t* acquire_frame();
+
+    // Unlock the PRU(s) once the frame returned by acquire_frame() is written
+    void present_frame();
+
+    // Frames presented to the PRU(s)
+    uint64_t frames() const { return frames_.load(std::memory_order_relaxed); }
+    // Time spent waiting for the PRU(s) to be ready
+    const histogram& wait_time() const { return wait_time_; }
 
 private:
     void write_rproc_sysfs(int pru_id, const char* filenae, const char* value);
@@ -65,6 +66,9 @@ private:
     uint8_t* shared_memory_;
     uint16_t* flag_pru_;
     uint32_t* frame_;
+
+    histogram wait_time_;
+    std::atomic<uint64_t> frames_{ 0 };
 };
 }
 
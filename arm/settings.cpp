@@ -16,6 +16,7 @@
 
 #include "settings.hpp"
 #include <spdlog/spdlog.h>
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <json.hpp>
@@ -45,7 +46,15 @@ void settings::load_settings()
     const nlohmann::json& j2 = j.at("strips");
     const nlohmann::json& j3 = j.at("leds");
 
-    server_ports = j1.at("ports").get<std::vector<uint16_t>>();
+    server = {
+        j1.at("ports").get<std::vector<uint16_t>>(),
+        j1.value("udp", false),
+        j1.value("websocket_deflate", false),
+        j1.value("deflate_window_bits", 15),
+        // Never more than a maximal OPC message in a websocket frame
+        std::min(j1.value("max_message_size", (1 << 16) + 8), (1 << 16) + 8),
+        j1.value("backend", "epoll") == "io_uring" ? io_backend::io_uring : io_backend::epoll
+    };
 
     driver = {
         j2.at("length").get<int>(),
@@ -54,6 +63,66 @@ void settings::load_settings()
         j3.at("dithering").get<bool>(),
         j3.at("brightness").get<float>()
     };
+
+    // Optional section
+    const nlohmann::json j4 = j.value("output", nlohmann::json::object());
+    output = {
+        j4.value("policy", "latest") == "queue" ? frame_policy::queue : frame_policy::latest,
+        j4.value("queue_depth", 8),
+        j4.value("interpolation", false)
+    };
+
+    // Optional section
+    const nlohmann::json j5 = j.value("dmx", nlohmann::json::object());
+    dmx.e131 = j5.value("e131", false);
+    dmx.artnet = j5.value("artnet", false);
+    dmx.universes.clear();
+    for (auto& u : j5.value("universes", nlohmann::json::array())) {
+        dmx.universes.push_back({
+            u.at("universe").get<uint16_t>(),
+            u.at("strip").get<int>(),
+            u.value("pixel", 0),
+            u.value("count", 170)
+        });
+    }
+
+    // Optional section
+    const nlohmann::json j6 = j.value("channels", nlohmann::json::object());
+    composer.end_of_frame = j6.value("commit", "immediate") == "end_of_frame";
+    composer.channels.clear();
+    for (auto& c : j6.value("map", nlohmann::json::array())) {
+        composer.channels.push_back({
+            c.at("channel").get<uint8_t>(),
+            c.at("strip").get<int>(),
+            c.value("strips", 1)
+        });
+    }
+    composer.layers.clear();
+    for (auto& l : j6.value("layers", nlohmann::json::array())) {
+        const std::string blend = l.value("blend", "normal");
+        composer.layers.push_back({
+            l.at("channel").get<uint8_t>(),
+            l.value("priority", 0),
+            l.value("opacity", 1.0f),
+            blend == "add" ? layer_blend::add : blend == "lighten" ? layer_blend::lighten : layer_blend::normal,
+            l.value("timeout", 0)
+        });
+    }
+
+    // Optional section
+    const nlohmann::json j7 = j.value("shm", nlohmann::json::object());
+    shm.enabled = j7.value("enabled", false);
+    shm.name = j7.value("name", "/epilepsia");
+    shm.slots = j7.value("slots", 4);
+
+    // Optional section
+    const nlohmann::json j8 = j.value("power", nlohmann::json::object());
+    driver.red_current = j8.value("red", 20.f);
+    driver.green_current = j8.value("green", 20.f);
+    driver.blue_current = j8.value("blue", 20.f);
+    driver.idle_current = j8.value("idle", 1.f);
+    driver.estimate_current = j8.value("estimate", true);
+    driver.max_current = j8.value("max_current", 0.f);
 }
 
 void settings::dump_settings()
@@ -61,7 +130,12 @@ void settings::dump_settings()
     std::ofstream o(file_);
     auto j = nlohmann::json{
         { "server", {
-            {"ports", server_ports } 
+            {"ports", server.ports },
+            {"udp", server.udp },
+            {"websocket_deflate", server.websocket_deflate },
+            {"deflate_window_bits", server.deflate_window_bits },
+            {"max_message_size", server.max_message_size },
+            {"backend", server.backend == io_backend::io_uring ? "io_uring" : "epoll" }
             } },
         { "strips", {
             { "length", driver.strip_length },
@@ -70,8 +144,56 @@ void settings::dump_settings()
         { "leds", {
             { "zigzag", driver.zigzag },
             { "dithering", driver.dithering },
-            { "brightness", driver.brightness } } }
+            { "brightness", driver.brightness } } },
+        { "power", {
+            { "red", driver.red_current },
+            { "green", driver.green_current },
+            { "blue", driver.blue_current },
+            { "idle", driver.idle_current },
+            { "estimate", driver.estimate_current },
+            { "max_current", driver.max_current } } },
+        { "output", {
+            { "policy", output.policy == frame_policy::queue ? "queue" : "latest" },
+            { "queue_depth", output.queue_depth },
+            { "interpolation", output.interpolation } } },
+        { "dmx", {
+            { "e131", dmx.e131 },
+            { "artnet", dmx.artnet },
+            { "universes", nlohmann::json::array() } } },
+        { "channels", {
+            { "commit", composer.end_of_frame ? "end_of_frame" : "immediate" },
+            { "map", nlohmann::json::array() },
+            { "layers", nlohmann::json::array() } } },
+        { "shm", {
+            { "enabled", shm.enabled },
+            { "name", shm.name },
+            { "slots", shm.slots } } }
     };
+
+    for (auto& u : dmx.universes) {
+        j["dmx"]["universes"].push_back({
+            { "universe", u.universe },
+            { "strip", u.strip },
+            { "pixel", u.pixel },
+            { "count", u.count } });
+    }
+
+    for (auto& c : composer.channels) {
+        j["channels"]["map"].push_back({
+            { "channel", c.channel },
+            { "strip", c.strip },
+            { "strips", c.strips } });
+    }
+
+    for (auto& l : composer.layers) {
+        j["channels"]["layers"].push_back({
+            { "channel", l.channel },
+            { "priority", l.priority },
+            { "opacity", l.opacity },
+            { "blend", l.blend == layer_blend::add ? "add" : l.blend == layer_blend::lighten ? "lighten" : "normal" },
+            { "timeout", l.timeout_ms } });
+    }
+
     o << std::setw(4) << j << std::endl;
 }
 
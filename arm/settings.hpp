@@ -17,7 +17,12 @@
 #ifndef EPILEPSIASETTINGS_H
 #define EPILEPSIASETTINGS_H
 
+#include "dmxreceiver.hpp"
+#include "framecomposer.hpp"
+#include "frameoutput.hpp"
 #include "leddriver.hpp"
+#include "opcserver.hpp"
+#include "shmreceiver.hpp"
 #include <string>
 #include <vector>
 
@@ -30,8 +35,12 @@ public:
     void load_settings();
     void dump_settings();
 
-    std::vector<uint16_t> server_ports;
+    opc_server_settings server;
     led_driver_settings driver;
+    frame_output_settings output;
+    dmx_settings dmx;
+    frame_composer_settings composer;
+    shm_settings shm;
 
 private:
     std::string file_;
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "shmreceiver.hpp"
+#include <spdlog/spdlog.h>
+#include <errno.h>
+#include <string.h>
+
+namespace epilepsia {
+
+shm_receiver::shm_receiver(const shm_settings& settings, const led_driver_settings& driver)
+    : settings_(settings)
+    , frame_size_(driver.strip_length * driver.strip_count * 3)
+{
+}
+
+shm_receiver::~shm_receiver()
+{
+    stop();
+}
+
+bool shm_receiver::start()
+{
+    if (!running_) {
+        if (!settings_.enabled) {
+            return true;
+        }
+        if (create()) {
+            running_ = true;
+            thread_ = std::thread(&shm_receiver::run, this);
+            return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+void shm_receiver::stop()
+{
+    if (running_) {
+        running_ = false;
+
+        // Wake up the thread, the value of head no longer matters. Changing
+        // it keeps the thread from going to sleep if it was about to, and the
+        // thread checks running_ before using it.
+        header_->head.fetch_add(1, std::memory_order_release);
+        shm_ring_futex(&header_->head, FUTEX_WAKE, 1);
+        thread_.join();
+        destroy();
+    }
+}
+
+bool shm_receiver::create()
+{
+    uint32_t slots = 2;
+    while (slots < static_cast<uint32_t>(settings_.slots)) {
+        slots *= 2;
+    }
+    const uint32_t slot_size = (frame_size_ + 63) & ~63u;
+    size_ = shm_ring_size(slot_size, slots);
+
+    // Start from a fresh ring, whatever a previous instance left behind
+    shm_unlink(settings_.name.c_str());
+    int fd = shm_open(settings_.name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        spdlog::error("Could not create shared memory {}: {}", settings_.name, strerror(errno));
+        return false;
+    }
+
+    // Producers may run as another user, don't let the umask get in the way
+    fchmod(fd, 0666);
+
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, size_) == 0) {
+        p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+
+    if (p == MAP_FAILED) {
+        spdlog::error("Could not map shared memory {}: {}", settings_.name, strerror(errno));
+        shm_unlink(settings_.name.c_str());
+        return false;
+    }
+
+    // The memory is zeroed by ftruncate, the magic goes last
+    header_ = static_cast<shm_ring_header*>(p);
+    header_->version = shm_ring_version;
+    header_->frame_size = frame_size_;
+    header_->slot_count = slots;
+    header_->slot_size = slot_size;
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = shm_ring_magic;
+
+    spdlog::info("Shared memory frame ring {}: {} slots of {} bytes", settings_.name, slots, frame_size_);
+    return true;
+}
+
+void shm_receiver::destroy()
+{
+    if (header_) {
+        munmap(header_, size_);
+        shm_unlink(settings_.name.c_str());
+        header_ = nullptr;
+    }
+}
+
+void shm_receiver::run()
+{
+    uint8_t* slots = reinterpret_cast<uint8_t*>(header_ + 1);
+    uint32_t tail = 0;
+
+    while (running_) {
+        uint32_t head = header_->head.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            // Sleep until a producer publishes a frame
+            if (shm_ring_futex(&header_->head, FUTEX_WAIT, head) < 0 && errno != EAGAIN && errno != EINTR) {
+                spdlog::error("futex wait failed: {}", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        // Woken up by stop(), head does not point to a frame
+        if (!running_) {
+            break;
+        }
+
+        // Skip to the most recent frame, its slot is ours until the next iteration
+        tail = head;
+        header_->tail.store(tail, std::memory_order_release);
+
+        if (handler_) {
+            handler_(slots + static_cast<size_t>((head - 1) % header_->slot_count) * header_->slot_size, frame_size_);
+        }
+    }
+}
+
+} // namespace epilepsia
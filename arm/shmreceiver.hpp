@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIASHMRECEIVER_H
+#define EPILEPSIASHMRECEIVER_H
+
+#include "leddriver.hpp"
+#include "shmring.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace epilepsia {
+
+struct shm_settings {
+    bool enabled{ false };
+    std::string name{ "/epilepsia" };
+    // Rounded up to a power of two
+    int slots{ 4 };
+};
+
+/**
+ * Consumer side of the shared memory frame ring (see shmring.hpp).
+ * The most recent frame is handed over to the handler without copy, the
+ * slot stays reserved until the handler returns.
+ */
+class shm_receiver {
+public:
+    using Handler = std::function<void(const uint8_t*, int)>;
+
+    shm_receiver(const shm_settings& settings, const led_driver_settings& driver);
+    ~shm_receiver();
+
+    shm_receiver(shm_receiver const&) = delete;
+    shm_receiver& operator=(shm_receiver const&) = delete;
+
+    bool start();
+    void stop();
+
+    template <typename T>
+    void set_handler(T&& handler) noexcept
+    {
+        handler_ = handler;
+    }
+
+private:
+    void run();
+    bool create();
+    void destroy();
+
+    const shm_settings settings_;
+    const uint32_t frame_size_;
+    shm_ring_header* header_{ nullptr };
+    size_t size_{ 0 };
+
+    Handler handler_;
+    std::thread thread_;
+    std::atomic<bool> running_{ false };
+};
+
+} // namespace epilepsia
+
+#endif // EPILEPSIASHMRECEIVER_H
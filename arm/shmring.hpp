@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIASHMRING_H
+#define EPILEPSIASHMRING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Shared memory frame ring, for generators running on the same board.
+ *
+ * epilepsia creates the ring when "shm" is enabled in its configuration.
+ * The producer only needs this header (link with -lrt on older glibc):
+ *
+ *     epilepsia::shm_producer ring;
+ *     if (ring.open("/epilepsia")) {
+ *         while (...) {
+ *             uint8_t* frame = ring.acquire();
+ *             if (frame) {
+ *                 // Write ring.frame_size() bytes of RGB
+ *                 ring.publish();
+ *             }
+ *         }
+ *     }
+ *
+ * A frame covers the whole display, like OPC channel 0. The driver always
+ * plays the most recent frame, and renders it straight from its slot.
+ *
+ * The ring has a single producer: acquire() and publish() don't synchronize
+ * writers with each other, two processes writing at once would share slots.
+ */
+
+namespace epilepsia {
+
+constexpr uint32_t shm_ring_magic = 0x4C495045; // "EPIL"
+constexpr uint32_t shm_ring_version = 1;
+
+/**
+ * At the start of the shared memory, followed by slot_count slots of
+ * frame_size bytes, each aligned on 64 bytes.
+ */
+struct shm_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frame_size;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t reserved[11];
+
+    // Frames published so far, frame n lives in slot n % slot_count.
+    // Also the futex the consumer sleeps on.
+    alignas(64) std::atomic<uint32_t> head;
+    // Frames consumed so far. Slot (tail - 1) % slot_count may be in use.
+    alignas(64) std::atomic<uint32_t> tail;
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32 bits word");
+
+inline size_t shm_ring_size(uint32_t slot_size, uint32_t slot_count)
+{
+    return sizeof(shm_ring_header) + static_cast<size_t>(slot_size) * slot_count;
+}
+
+inline long shm_ring_futex(std::atomic<uint32_t>* word, int op, uint32_t value, const timespec* timeout = nullptr)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, nullptr, 0);
+}
+
+/**
+ * Writing end of the ring. Only one may write at a time.
+ */
+class shm_producer {
+public:
+    shm_producer() = default;
+    shm_producer(shm_producer const&) = delete;
+    shm_producer& operator=(shm_producer const&) = delete;
+
+    ~shm_producer() { close(); }
+
+    bool open(const char* name)
+    {
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(shm_ring_header)) {
+            ::close(fd);
+            return false;
+        }
+
+        void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+
+        header_ = static_cast<shm_ring_header*>(p);
+        size_ = st.st_size;
+        if (header_->magic != shm_ring_magic || header_->version != shm_ring_version
+            || shm_ring_size(header_->slot_size, header_->slot_count) > size_) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (header_) {
+            munmap(header_, size_);
+            header_ = nullptr;
+        }
+    }
+
+    int frame_size() const { return header_->frame_size; }
+
+    /**
+     * Returns the slot to write the next frame into, or nullptr if the
+     * driver is that many frames behind. Call publish() when done.
+     */
+    uint8_t* acquire()
+    {
+        uint32_t head = header_->head.load(std::memory_order_relaxed);
+        uint32_t tail = header_->tail.load(std::memory_order_acquire);
+        if (head - tail >= header_->slot_count - 1) {
+            return nullptr;
+        }
+        return slot(head);
+    }
+
+    void publish()
+    {
+        header_->head.fetch_add(1, std::memory_order_release);
+        shm_ring_futex(&header_->head, FUTEX_WAKE, 1);
+    }
+
+private:
+    uint8_t* slot(uint32_t n)
+    {
+        return reinterpret_cast<uint8_t*>(header_ + 1) + static_cast<size_t>(n % header_->slot_count) * header_->slot_size;
+    }
+
+    shm_ring_header* header_{ nullptr };
+    size_t size_{ 0 };
+};
+
+} // namespace epilepsia
+
+#endif // EPILEPSIASHMRING_H
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Parsing of E1.31 data packets: the fields, the Preview_Data (0x80) and
+ * Stream_Terminated (0x40) options, and the packets that must be ignored.
+ */
+
+#include "dmxreceiver.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace epilepsia;
+
+static int failures = 0;
+
+static void expect(bool condition, const char* what)
+{
+    if (!condition) {
+        std::printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static void put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+// Data packet of 3 channels on universe 7, synchronized on universe 9
+static std::vector<uint8_t> packet(uint8_t options, uint8_t start_code = 0)
+{
+    std::vector<uint8_t> p(126 + 3, 0);
+    const char identifier[] = "ASC-E1.17";
+    std::copy(identifier, identifier + 9, p.begin() + 4);
+    put32(&p[18], 0x00000004);
+    put32(&p[40], 0x00000002);
+    put16(&p[109], 9);
+    p[111] = 42;
+    p[112] = options;
+    put16(&p[113], 7);
+    put16(&p[123], 4);
+    p[125] = start_code;
+    p[126] = 1;
+    p[127] = 2;
+    p[128] = 3;
+    return p;
+}
+
+int main()
+{
+    e131_data data;
+
+    auto p = packet(0);
+    expect(parse_e131_data(p.data(), p.size(), data), "live data is parsed");
+    expect(data.universe == 7 && data.sync_address == 9 && data.sequence == 42, "header fields");
+    expect(data.count == 3 && data.channels == p.data() + 126 && data.channels[2] == 3, "channels");
+    expect(!data.preview && !data.terminated, "no option set");
+
+    p = packet(0x80);
+    expect(parse_e131_data(p.data(), p.size(), data), "preview data is parsed");
+    expect(data.preview && !data.terminated, "0x80 is Preview_Data");
+
+    p = packet(0x40);
+    expect(parse_e131_data(p.data(), p.size(), data), "terminated stream is parsed");
+    expect(!data.preview && data.terminated, "0x40 is Stream_Terminated");
+
+    p = packet(0xC0);
+    expect(parse_e131_data(p.data(), p.size(), data) && data.preview && data.terminated, "both options");
+
+    p = packet(0x20);
+    expect(parse_e131_data(p.data(), p.size(), data) && !data.preview && !data.terminated, "Force_Synchronization is neither");
+
+    p = packet(0, 0xDD);
+    expect(!parse_e131_data(p.data(), p.size(), data), "non-null start code is ignored");
+
+    p = packet(0);
+    expect(!parse_e131_data(p.data(), 125, data), "truncated packet is ignored");
+    put16(&p[123], 200);
+    expect(parse_e131_data(p.data(), p.size(), data) && data.count == 3, "channel count bounded by the packet");
+
+    p = packet(0);
+    put32(&p[40], 0x00000001);
+    expect(!parse_e131_data(p.data(), p.size(), data), "sync packet is not data");
+
+    if (failures) {
+        return EXIT_FAILURE;
+    }
+    std::printf("E1.31 parsing: OK\n");
+    return EXIT_SUCCESS;
+}
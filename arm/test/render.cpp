@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * The blocked pipelines of frame_renderer against a straightforward model
+ * rendering one LED at a time: gamma correction and brightness through the
+ * same tables, GRB order, zigzag, temporal dithering and the bit by bit
+ * transposition. Frames are random, partly changed or short, 8 and 16 bit,
+ * while brightness, dithering and zigzag change. Every frame rendered and
+ * the current estimated for every strip must be exactly the model's.
+ */
+
+#include "bittranspose.hpp"
+#include "dithering.hpp"
+#include "framerenderer.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace epilepsia;
+
+namespace {
+
+const std::array<uint8_t, 256> gamma8{
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
+    2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5,
+    5, 6, 6, 6, 6, 7, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10,
+    10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 15, 15, 16, 16,
+    17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23, 24, 24, 25,
+    25, 26, 27, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 35, 35, 36,
+    37, 38, 39, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 50,
+    51, 52, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 66, 67, 68,
+    69, 70, 72, 73, 74, 75, 77, 78, 79, 81, 82, 83, 85, 86, 87, 89,
+    90, 92, 93, 95, 96, 98, 99, 101, 102, 104, 105, 107, 109, 110, 112, 114,
+    115, 117, 119, 120, 122, 124, 126, 127, 129, 131, 133, 135, 137, 138, 140, 142,
+    144, 146, 148, 150, 152, 154, 156, 158, 160, 162, 164, 167, 169, 171, 173, 175,
+    177, 180, 182, 184, 186, 189, 191, 193, 196, 198, 200, 203, 205, 208, 210, 213,
+    215, 218, 220, 223, 225, 228, 231, 233, 236, 239, 241, 244, 247, 249, 252, 255
+};
+
+class model {
+public:
+    explicit model(const led_driver_settings& settings)
+        : settings_(settings)
+        , bytes_per_strip_(settings.strip_length * 3)
+        , columns_(bytes_per_strip_ / 4)
+        , residual_(bytes_per_strip_ * settings.strip_count)
+        , grb_(columns_ * settings.strip_count)
+        , output_(grb_.size())
+        , levels_(settings.strip_count * 3)
+    {
+    }
+
+    const std::vector<uint32_t>& render(const uint8_t* buffer, int len, pixel_format format)
+    {
+        const float brightness = std::min(settings_.brightness, 1.f);
+        uint8_t* out = reinterpret_cast<uint8_t*>(grb_.data());
+        const int half = settings_.strip_length / 2;
+        std::fill(levels_.begin(), levels_.end(), 0);
+
+        for (auto k = 0; k < settings_.strip_count; k++) {
+            for (auto i = 0; i < settings_.strip_length; i++) {
+                const int led = settings_.zigzag && i >= half ? 3 * half - 1 - i : i;
+
+                // G, R and B
+                for (auto c = 0; c < 3; c++) {
+                    const int channel = c == 0 ? 1 : c == 1 ? 0 : 2;
+                    int d;
+                    if (format == pixel_format::rgb16) {
+                        const int j = (k * bytes_per_strip_ + led * 3 + channel) * 2;
+                        d = j + 1 < len ? level16(buffer[j], buffer[j + 1], brightness) : 0;
+                    } else {
+                        const int j = k * bytes_per_strip_ + led * 3 + channel;
+                        d = static_cast<int>(gamma8[j < len ? buffer[j] : 0] * 257 * brightness);
+                    }
+
+                    const int n = k * bytes_per_strip_ + i * 3 + c;
+                    const uint8_t e = settings_.dithering ? dither(d, residual_[n]) : d >> 8;
+                    out[n] = e;
+                    levels_[k * 3 + c] += e;
+                }
+            }
+        }
+
+        if (settings_.strip_count == 8) {
+            remap_bits_reference<uint8_t>(grb_.data(), output_.data(), columns_, 0, columns_);
+        } else if (settings_.strip_count == 16) {
+            remap_bits_reference<uint16_t>(grb_.data(), output_.data(), columns_, 0, columns_);
+        } else {
+            remap_bits_reference<uint32_t>(grb_.data(), output_.data(), columns_, 0, columns_);
+        }
+        return output_;
+    }
+
+    int current(int strip) const
+    {
+        const int* level = levels_.data() + strip * 3;
+        const float dynamic = level[0] * settings_.green_current + level[1] * settings_.red_current + level[2] * settings_.blue_current;
+        return dynamic / 255 + settings_.idle_current * settings_.strip_length;
+    }
+
+private:
+    // Linear interpolation between the gamma curve sampled every 256 values
+    static int level16(int high, int low, float brightness)
+    {
+        auto gamma = [](int i) { return std::pow(std::min(i * 256, 65535) / 65535.f, 2.8f); };
+        const int base = gamma(high) * 65535 * brightness + 0.5f;
+        const int next = gamma(high + 1) * 65535 * brightness + 0.5f;
+        return base + (((next - base) * low) >> 8);
+    }
+
+    const led_driver_settings& settings_;
+    const int bytes_per_strip_;
+    const int columns_;
+    std::vector<int16_t> residual_;
+    std::vector<uint32_t> grb_;
+    std::vector<uint32_t> output_;
+    std::vector<int> levels_;
+};
+
+// Returns the number of frames that differ from the model
+int check(int strip_length, int strip_count)
+{
+    led_driver_settings settings;
+    settings.strip_length = strip_length;
+    settings.strip_count = strip_count;
+    settings.brightness = 0.6f;
+    frame_renderer renderer(settings);
+    model reference(settings);
+
+    const int frame_size = strip_length * strip_count * 3;
+    std::vector<uint8_t> frame(frame_size), wide(frame_size * 2);
+    std::srand(strip_length * 1000 + strip_count);
+    for (auto& b : frame) {
+        b = std::rand();
+    }
+
+    int failures = 0;
+    for (auto f = 0; f < 400; f++) {
+        // Settings changes, applied between two frames like led_driver does
+        switch (f % 100) {
+        case 20:
+            settings.dithering = !settings.dithering;
+            renderer.update_pipeline();
+            break;
+        case 40:
+            settings.brightness = settings.brightness < 0.5f ? 1.f : 0.25f;
+            renderer.update_lut();
+            break;
+        case 60:
+            settings.zigzag = !settings.zigzag;
+            renderer.update_pipeline();
+            break;
+        }
+
+        pixel_format format = pixel_format::rgb8;
+        int len = frame_size;
+        const uint8_t* data = frame.data();
+
+        switch (f % 8) {
+        case 0:
+            // New frame
+            for (auto& b : frame) {
+                b = std::rand();
+            }
+            break;
+        case 5:
+            // Short frame
+            len = std::rand() % frame_size;
+            break;
+        case 6:
+            // 16 bit frame, possibly short
+            for (auto& b : wide) {
+                b = std::rand();
+            }
+            format = pixel_format::rgb16;
+            len = f % 3 ? frame_size * 2 : std::rand() % (frame_size * 2);
+            data = wide.data();
+            break;
+        default:
+            // A few bytes change, the rest of the frame is the same
+            for (auto n = std::rand() % 8; n > 0; n--) {
+                frame[std::rand() % frame_size] = std::rand();
+            }
+            break;
+        }
+
+        const uint32_t* out = renderer.render(data, len, format);
+        const std::vector<uint32_t>& expected = reference.render(data, len, format);
+
+        bool same = std::equal(expected.begin(), expected.end(), out);
+        for (auto k = 0; k < strip_count; k++) {
+            same = same && renderer.current(k) == reference.current(k);
+        }
+        if (!same) {
+            std::printf("%d strips of %d LEDs, frame %d (%s%s%s, brightness %.2f): differs from the model\n",
+                strip_count, strip_length, f, format == pixel_format::rgb16 ? "16 bit" : "8 bit",
+                settings.dithering ? ", dithering" : "", settings.zigzag ? ", zigzag" : "", settings.brightness);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+} // namespace
+
+int main()
+{
+    // Specialized pipelines first, then generic ones
+    const int configs[][2] = { { 64, 32 }, { 120, 16 }, { 64, 8 }, { 12, 32 }, { 100, 8 }, { 4, 16 } };
+
+    int failures = 0;
+    for (auto& c : configs) {
+        failures += check(c[0], c[1]);
+    }
+
+    if (failures) {
+        return EXIT_FAILURE;
+    }
+    std::printf("Rendering: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "websocket.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace epilepsia {
+
+void websocket_unmask(uint8_t* data, size_t len, const uint8_t* key, size_t phase)
+{
+    size_t i = 0;
+
+    // Byte by byte until data is 16 bytes aligned
+    for (; i < len && (reinterpret_cast<uintptr_t>(data + i) & 15); i++) {
+        data[i] ^= key[(phase + i) & 3];
+    }
+
+    // Key rotated so that its first byte applies to data[i]
+    uint8_t rotated[4];
+    for (size_t j = 0; j < 4; j++) {
+        rotated[j] = key[(phase + i + j) & 3];
+    }
+    uint32_t key32;
+    std::memcpy(&key32, rotated, 4);
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t key128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), key128));
+    }
+#elif defined(__SSE2__)
+    const __m128i key128 = _mm_set1_epi32(key32);
+    for (; i + 16 <= len; i += 16) {
+        auto p = reinterpret_cast<__m128i*>(data + i);
+        _mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), key128));
+    }
+#endif
+
+    // i is still a multiple of 4 away from the aligned start
+    for (; i + 4 <= len; i += 4) {
+        uint32_t word;
+        std::memcpy(&word, data + i, 4);
+        word ^= key32;
+        std::memcpy(data + i, &word, 4);
+    }
+
+    for (; i < len; i++) {
+        data[i] ^= key[(phase + i) & 3];
+    }
+}
+
+namespace {
+
+    std::string trim(const std::string& s)
+    {
+        auto begin = s.find_first_not_of(" \t");
+        auto end = s.find_last_not_of(" \t");
+        return begin == std::string::npos ? "" : s.substr(begin, end - begin + 1);
+    }
+
+} // namespace
+
+bool websocket_negotiate_deflate(const std::string& offers, int max_window_bits,
+    websocket_deflate_params& params, std::string& response)
+{
+    std::istringstream offers_stream(offers);
+    std::string offer;
+
+    // Offers are separated by commas, in order of preference
+    while (std::getline(offers_stream, offer, ',')) {
+        std::istringstream offer_stream(offer);
+        std::string param;
+
+        std::getline(offer_stream, param, ';');
+        if (trim(param) != "permessage-deflate") {
+            continue;
+        }
+
+        bool acceptable = true;
+        bool client_window_bits = false;
+        websocket_deflate_params p;
+        std::string extra;
+
+        while (std::getline(offer_stream, param, ';')) {
+            param = trim(param);
+            auto i = param.find('=');
+            auto name = trim(param.substr(0, i));
+            auto value = i == std::string::npos ? "" : trim(param.substr(i + 1));
+            if (!value.empty() && value.front() == '"') {
+                value = value.substr(1, value.length() - 2);
+            }
+
+            if (name == "client_max_window_bits") {
+                client_window_bits = true;
+                if (!value.empty()) {
+                    p.client_max_window_bits = std::atoi(value.c_str());
+                }
+            } else if (name == "client_no_context_takeover") {
+                p.client_no_context_takeover = true;
+            } else if (name == "server_no_context_takeover") {
+                // We never send compressed messages, so this is free
+                extra += "; server_no_context_takeover";
+            } else if (name == "server_max_window_bits") {
+                // Echoed, we never send compressed messages. A missing or
+                // invalid value makes the offer invalid (RFC 7692 7.1.2.1)
+                const bool digits = value.length() <= 2 && value.find_first_not_of("0123456789") == std::string::npos;
+                const int bits = digits ? std::atoi(value.c_str()) : 0;
+                if (bits >= 8 && bits <= 15) {
+                    extra += "; server_max_window_bits=" + std::to_string(bits);
+                } else {
+                    acceptable = false;
+                }
+            } else {
+                acceptable = false;
+            }
+        }
+
+        // The client must let us limit the size of its window
+        if (p.client_max_window_bits > max_window_bits) {
+            acceptable = acceptable && client_window_bits;
+            p.client_max_window_bits = max_window_bits;
+        }
+
+        // zlib does not support 8 bits windows for raw deflate streams
+        if (!acceptable || p.client_max_window_bits < 9 || p.client_max_window_bits > 15) {
+            continue;
+        }
+
+        params = p;
+        response = "permessage-deflate";
+        if (client_window_bits) {
+            response += "; client_max_window_bits=" + std::to_string(p.client_max_window_bits);
+        }
+        if (p.client_no_context_takeover) {
+            response += "; client_no_context_takeover";
+        }
+        response += extra;
+        return true;
+    }
+
+    return false;
+}
+
+websocket_inflater::websocket_inflater(const websocket_deflate_params& params)
+    : no_context_takeover_(params.client_no_context_takeover)
+{
+    stream_ = {};
+    // Negative window bits: raw deflate stream, no zlib header
+    inflateInit2(&stream_, -params.client_max_window_bits);
+}
+
+websocket_inflater::~websocket_inflater()
+{
+    inflateEnd(&stream_);
+}
+
+int websocket_inflater::inflate(const uint8_t* in, size_t len, uint8_t* out, size_t out_size)
+{
+    // The sender removed this empty stored block from the end of the message
+    static const uint8_t tail[] = { 0x00, 0x00, 0xFF, 0xFF };
+
+    auto start = std::chrono::steady_clock::now();
+
+    stream_.next_out = out;
+    stream_.avail_out = out_size;
+
+    for (auto chunk : { std::make_pair(in, len), std::make_pair(tail, sizeof(tail)) }) {
+        stream_.next_in = const_cast<uint8_t*>(chunk.first);
+        stream_.avail_in = chunk.second;
+
+        int ret = ::inflate(&stream_, Z_SYNC_FLUSH);
+        if (ret == Z_STREAM_END) {
+            // The sender ended the deflate stream (BFINAL), start a new one
+            inflateReset(&stream_);
+            break;
+        }
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || stream_.avail_in != 0) {
+            // Corrupted message or not enough room for it
+            return -1;
+        }
+    }
+
+    int inflated = out_size - stream_.avail_out;
+
+    if (no_context_takeover_) {
+        inflateReset(&stream_);
+    }
+
+    inflate_time_ += std::chrono::steady_clock::now() - start;
+    compressed_bytes_ += len;
+    inflated_bytes_ += inflated;
+    messages_++;
+
+    return inflated;
+}
+
+} // namespace epilepsia
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018-2019 Simon Guigui
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EPILEPSIAWEBSOCKET_H
+#define EPILEPSIAWEBSOCKET_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <zlib.h>
+
+namespace epilepsia {
+
+/**
+ * XOR data with the 4 bytes masking key of a websocket frame.
+ * phase is the position of data[0] in the payload of the frame, so that
+ * a payload can be unmasked in several chunks.
+ */
+void websocket_unmask(uint8_t* data, size_t len, const uint8_t* key, size_t phase = 0);
+
+/**
+ * Parameters of the permessage-deflate extension (RFC 7692) agreed upon
+ * during the handshake.
+ */
+struct websocket_deflate_params {
+    int client_max_window_bits{ 15 };
+    bool client_no_context_takeover{ false };
+};
+
+/**
+ * Look for an acceptable permessage-deflate offer in the value of a
+ * Sec-WebSocket-Extensions header. The LZ77 window of the client is capped
+ * to max_window_bits, offers that don't let us do that are declined.
+ * On success, response holds the value of the Sec-WebSocket-Extensions
+ * header to send back.
+ */
+bool websocket_negotiate_deflate(const std::string& offers, int max_window_bits,
+    websocket_deflate_params& params, std::string& response);
+
+/**
+ * Decompress permessage-deflate messages and keep track of the
+ * compression ratio and of the time spent inflating.
+ */
+class websocket_inflater {
+public:
+    explicit websocket_inflater(const websocket_deflate_params& params);
+    ~websocket_inflater();
+
+    websocket_inflater(websocket_inflater const&) = delete;
+    websocket_inflater& operator=(websocket_inflater const&) = delete;
+
+    /**
+     * Inflate a complete message. Returns the size of the decompressed
+     * message, or -1 if it is corrupted or does not fit in out_size bytes.
+     */
+    int inflate(const uint8_t* in, size_t len, uint8_t* out, size_t out_size);
+
+    uint64_t messages() const { return messages_; }
+    uint64_t compressed_bytes() const { return compressed_bytes_; }
+    uint64_t inflated_bytes() const { return inflated_bytes_; }
+    std::chrono::nanoseconds inflate_time() const { return inflate_time_; }
+
+private:
+    z_stream stream_;
+    const bool no_context_takeover_;
+    uint64_t messages_{ 0 };
+    uint64_t compressed_bytes_{ 0 };
+    uint64_t inflated_bytes_{ 0 };
+    std::chrono::nanoseconds inflate_time_{ 0 };
+};
+
+} // namespace epilepsia
+
+#endif // EPILEPSIAWEBSOCKET_H
@@ -128,6 +128,8 @@ class OpcClient(object):
             return False
 
         # build OPC message
+        if isinstance(data, (bytes, bytearray)):
+            data = [bytes(data)]
         header = struct.pack('>BBH', channel, command, length)
         if bytes is str:
             message = header + ''.join(data)
@@ -184,6 +186,14 @@ class Client(OpcClient):
 
     SET_BRIGHTNESS = 0x00
     SET_DITHERING = 0x01
+    END_OF_FRAME = 0x03
+    DELTA_FRAME = 0x04
+    COMPRESSED_FRAME = 0x05
+    FRAME_PRESENTED = 0x06
+
+    RLE = 0x00
+    LZ4 = 0x01
+    QOI = 0x02
 
     def set_brightness(self, brightness):
         command = struct.pack(
@@ -200,3 +210,97 @@ class Client(OpcClient):
             min(1, max(0, int(dithering)))
         )
         self.send_command(Client.SYSTEM_EXCLUSIVE, command, 2)
+
+    def end_of_frame(self):
+        """Commit the frame composed by the previous put_pixels calls.
+
+        Only needed when the server is configured to wait for an explicit
+        end of frame ("commit": "end_of_frame").
+
+        """
+        command = struct.pack('B', Client.END_OF_FRAME)
+        self.send_command(Client.SYSTEM_EXCLUSIVE, command, 1)
+
+    def subscribe_presented(self, enable=True):
+        """Ask the server to send a message each time a frame reaches the LEDs.
+
+        Read them with wait_presented().
+
+        """
+        command = struct.pack('BB', Client.FRAME_PRESENTED, 1 if enable else 0)
+        return self.send_command(Client.SYSTEM_EXCLUSIVE, command, 2)
+
+    def wait_presented(self):
+        """Block until the server presents a frame.
+
+        Return a (frame counter, timestamp in microseconds) tuple, or None
+        if the connection was lost. Timestamps come from the monotonic clock
+        of the server.
+
+        """
+        message = b''
+        try:
+            while len(message) < 17:
+                chunk = self._socket.recv(17 - len(message))
+                if not chunk:
+                    raise socket.error()
+                message += chunk
+        except (socket.error, AttributeError):
+            self._debug('wait_presented: connection lost.')
+            self._socket = None
+            return None
+        _, _, _, _, frame, timestamp = struct.unpack('>BBHBIQ', message)
+        return frame, timestamp
+
+    def put_ranges(self, ranges, channel=0):
+        """Update parts of the frame of a channel.
+
+        ranges: A list of (offset, data) tuples. offset is a byte offset
+            in the frame of the channel and data a bytes object of RGB
+            values. Pixels outside of these ranges keep their value.
+
+        """
+        pieces = [struct.pack('B', Client.DELTA_FRAME)]
+        for offset, data in ranges:
+            pieces.append(struct.pack('>HH', offset, len(data)))
+            pieces.append(bytes(data))
+        length = sum(len(piece) for piece in pieces)
+        return self.send_command(Client.SYSTEM_EXCLUSIVE, pieces, length, channel)
+
+    def put_compressed(self, codec, data, channel=0):
+        """Send a whole frame compressed with codec (RLE, LZ4 or QOI).
+
+        LZ4 data is a raw block (lz4.block.compress(..., store_size=False)),
+        QOI data a complete image. Use encode_rle to produce RLE data.
+
+        """
+        pieces = [struct.pack('B', Client.COMPRESSED_FRAME),
+                  struct.pack('B', codec), bytes(data)]
+        length = sum(len(piece) for piece in pieces)
+        return self.send_command(Client.SYSTEM_EXCLUSIVE, pieces, length, channel)
+
+    @staticmethod
+    def encode_rle(pixels):
+        """Run-length encode a list of (r, g, b) tuples.
+
+        A packet header n < 128 is followed by n + 1 literal pixels, a
+        header n >= 128 by one pixel repeated n - 127 times.
+
+        """
+        pixels = [bytes(int(min(255, max(0, v))) for v in p) for p in pixels]
+        out = bytearray()
+        i = 0
+        while i < len(pixels):
+            j = i
+            while j + 1 < len(pixels) and j - i < 127 and pixels[j + 1] == pixels[i]:
+                j += 1
+            if j > i:
+                out.append(128 + j - i)
+                out += pixels[i]
+            else:
+                while j + 1 < len(pixels) and j - i < 127 and pixels[j + 1] != pixels[j]:
+                    j += 1
+                out.append(j - i)
+                out += b''.join(pixels[i:j + 1])
+            i = j + 1
+        return bytes(out)
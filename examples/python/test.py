@@ -14,9 +14,12 @@ import numpy as np
 @click.option('-f', '--framerate', default=120.0, help='Frames per second')
 @click.option('-h', '--host', default='127.0.0.1', help='OPC server')
 @click.option('-p', '--port', default=7890, help='OPC server port')
-def main(framerate, host, port):
+@click.option('--vsync', is_flag=True, help='Pace frames on the LED refresh instead of the framerate')
+def main(framerate, host, port, vsync):
 
     client = opc.Client(host + ':' + str(port))
+    if vsync:
+        client.subscribe_presented()
     x_dim = 60
     y_dim = 32
     k = 0
@@ -32,7 +35,10 @@ def main(framerate, host, port):
 
         client.put_pixels(frame.reshape((x_dim*y_dim, -1)), channel=0)
 
-        time.sleep(max(1.0/framerate - (time.time() - start_time), 0))
+        if vsync:
+            client.wait_presented()
+        else:
+            time.sleep(max(1.0/framerate - (time.time() - start_time), 0))
 
 
 if __name__ == '__main__':